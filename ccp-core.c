@@ -0,0 +1,896 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * ccp-core.c - transport for Corsair controllers using 63 byte commands and 16 byte responses
+ * Copyright (C) 2020 Marius Zachmann <mail@mariuszachmann.de>
+ *
+ * The Commander Pro, the Lighting Node Pro and their relatives answer every command with
+ * one input report, in command order, without report ids. Commands are queued and sent by
+ * a worker which keeps up to depth commands in flight and hands out responses in order.
+ * When using hidraw and the drivers simultaniously, reports could be switched.
+ *
+ * Bulk traffic like led frames is queued with CCP_PRIO_LOW. It is only sent while no
+ * normal command waits and fills at most half of the depth, so sensor reads and fan
+ * settings are not held up by it for more than about one round trip.
+ *
+ * Within a priority, commands with the earliest deadline are sent first, commands
+ * without one go last. A command still queued when its deadline passes is failed with
+ * -ETIME without being sent, a sensor reading that old would be thrown away anyway.
+ * The commands of one submission share that outcome: they are dropped together while
+ * none of them is sent, and once the first one is sent the others follow even if late,
+ * so a led upload never loses its commit frame.
+ *
+ * Multi command settings can be submitted as an atomic batch. Once its first frame is
+ * sent, only its frames are sent until the last one, so other commands of the drivers
+ * cannot land between them. Tools get the same through the CCP_IOC_BATCH ioctl on the
+ * raw_cmd debugfs file, see ccp-ioctl.h. hidraw clients bypass the queue and can still
+ * interleave.
+ *
+ * For reproducing field problems, every frame, response and failure can be recorded with
+ * its timestamp in the debugfs capture log. tools/ccp-replay and ccp-emu --replay play
+ * such a log back.
+ *
+ * With CONFIG_FAULT_INJECTION_DEBUG_FS, send failures and dropped, delayed or failed
+ * responses can be injected through the fail_* debugfs directories, to measure timeouts
+ * and recovery under faults the hardware does not produce on demand.
+ */
+
+#include <linux/completion.h>
+#include <linux/debugfs.h>
+#include <linux/fault-inject.h>
+#include <linux/hid.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+
+#include "ccp-core.h"
+#include "ccp-ioctl.h"
+
+/* commands submitted together, the submitter waits for all of them */
+struct ccp_batch {
+	struct completion done;
+	int count;
+	int pending;
+	int unsent;
+	bool atomic;
+};
+
+static void ccp_core_capture(struct ccp_core *core, enum ccp_capture_type type, u32 seq,
+			     int status, const u8 *data, int len)
+{
+	struct ccp_capture_rec *rec;
+
+	lockdep_assert_held(&core->lock);
+
+	if (!core->capture)
+		return;
+
+	/* overwrite the oldest record, the reader notices by capture_read */
+	if (core->capture_written - core->capture_read >= CCP_CAPTURE_SIZE)
+		core->stats.capture_dropped++;
+
+	rec = &core->capture[core->capture_written++ % CCP_CAPTURE_SIZE];
+	rec->time = ktime_get();
+	rec->seq = seq;
+	rec->type = type;
+	rec->status = status;
+	rec->len = len;
+	memcpy(rec->data, data, len);
+}
+
+#ifdef CONFIG_FAULT_INJECTION_DEBUG_FS
+
+static void ccp_core_match(struct ccp_core *core, const u8 *data, int size);
+
+static bool ccp_core_fault_output(struct ccp_core *core)
+{
+	if (!should_fail(&core->fail_output, CCP_OUT_BUFFER_SIZE))
+		return false;
+
+	spin_lock_bh(&core->lock);
+	core->stats.faults++;
+	spin_unlock_bh(&core->lock);
+	return true;
+}
+
+static void ccp_core_fault_reply(struct ccp_core *core, struct ccp_cmd *cmd)
+{
+	if (!should_fail(&core->fail_device_error, 1))
+		return;
+
+	core->stats.faults++;
+	cmd->in[0] = core->fail_error_code;
+}
+
+/*
+ * Returns true if the response was dropped or held back. Responses arriving while one is
+ * held back wait behind it and follow it right away.
+ */
+static bool ccp_core_fault_rx(struct ccp_core *core, const u8 *data, int size)
+{
+	struct ccp_fault_delayed *d;
+	ktime_t due = ktime_get();
+
+	lockdep_assert_held(&core->lock);
+
+	if (should_fail(&core->fail_drop, size)) {
+		core->stats.faults++;
+		return true;
+	}
+
+	if (!core->delayed_count) {
+		if (!should_fail(&core->fail_delay, size))
+			return false;
+		core->stats.faults++;
+		due = ktime_add_ms(due, core->fail_delay_ms);
+		queue_delayed_work(system_highpri_wq, &core->fault_work,
+				   msecs_to_jiffies(core->fail_delay_ms));
+	} else if (core->delayed_count == CCP_FAULT_DELAY_SLOTS) {
+		/* out of slots, the oldest one goes through early to keep the order */
+		d = &core->delayed[core->delayed_head];
+		ccp_core_match(core, d->data, d->size);
+		core->delayed_head = (core->delayed_head + 1) % CCP_FAULT_DELAY_SLOTS;
+		core->delayed_count--;
+	}
+
+	d = &core->delayed[(core->delayed_head + core->delayed_count++) % CCP_FAULT_DELAY_SLOTS];
+	memcpy(d->data, data, min(CCP_IN_BUFFER_SIZE, size));
+	d->size = min(CCP_IN_BUFFER_SIZE, size);
+	d->due = due;
+	return true;
+}
+
+static void ccp_core_fault_work(struct work_struct *work)
+{
+	struct ccp_core *core = container_of(to_delayed_work(work), struct ccp_core, fault_work);
+	struct ccp_fault_delayed *d;
+	s64 wait_ms;
+
+	spin_lock_bh(&core->lock);
+	while (core->delayed_count) {
+		d = &core->delayed[core->delayed_head];
+		wait_ms = ktime_ms_delta(d->due, ktime_get());
+		if (wait_ms > 0) {
+			queue_delayed_work(system_highpri_wq, &core->fault_work,
+					   msecs_to_jiffies(wait_ms));
+			break;
+		}
+		ccp_core_match(core, d->data, d->size);
+		core->delayed_head = (core->delayed_head + 1) % CCP_FAULT_DELAY_SLOTS;
+		core->delayed_count--;
+	}
+	spin_unlock_bh(&core->lock);
+}
+
+static void ccp_core_fault_init(struct ccp_core *core)
+{
+	core->fail_output = (struct fault_attr)FAULT_ATTR_INITIALIZER;
+	core->fail_drop = (struct fault_attr)FAULT_ATTR_INITIALIZER;
+	core->fail_delay = (struct fault_attr)FAULT_ATTR_INITIALIZER;
+	core->fail_device_error = (struct fault_attr)FAULT_ATTR_INITIALIZER;
+	core->fail_delay_ms = CCP_REQ_TIMEOUT / 2;
+	core->fail_error_code = 0xff;
+	INIT_DELAYED_WORK(&core->fault_work, ccp_core_fault_work);
+}
+
+static void ccp_core_fault_debugfs_init(struct ccp_core *core, struct dentry *dir)
+{
+	fault_create_debugfs_attr("fail_output", dir, &core->fail_output);
+	fault_create_debugfs_attr("fail_drop", dir, &core->fail_drop);
+	fault_create_debugfs_attr("fail_delay", dir, &core->fail_delay);
+	fault_create_debugfs_attr("fail_device_error", dir, &core->fail_device_error);
+	debugfs_create_u32("fail_delay_ms", 0600, dir, &core->fail_delay_ms);
+	debugfs_create_u8("fail_error_code", 0600, dir, &core->fail_error_code);
+}
+
+static void ccp_core_fault_destroy(struct ccp_core *core)
+{
+	cancel_delayed_work_sync(&core->fault_work);
+}
+
+#else
+
+static bool ccp_core_fault_output(struct ccp_core *core)
+{
+	return false;
+}
+
+static void ccp_core_fault_reply(struct ccp_core *core, struct ccp_cmd *cmd)
+{
+}
+
+static bool ccp_core_fault_rx(struct ccp_core *core, const u8 *data, int size)
+{
+	return false;
+}
+
+static void ccp_core_fault_init(struct ccp_core *core)
+{
+}
+
+static void ccp_core_fault_debugfs_init(struct ccp_core *core, struct dentry *dir)
+{
+}
+
+static void ccp_core_fault_destroy(struct ccp_core *core)
+{
+}
+
+#endif
+
+static void ccp_core_finish(struct ccp_core *core, struct ccp_cmd *cmd, int status)
+{
+	lockdep_assert_held(&core->lock);
+
+	cmd->status = status;
+	if (--cmd->batch->pending == 0)
+		complete(&cmd->batch->done);
+}
+
+/* removes a command from the in flight list */
+static void ccp_core_retire(struct ccp_core *core, struct ccp_cmd *cmd)
+{
+	list_del(&cmd->node);
+	core->num_inflight--;
+	if (cmd->prio == CCP_PRIO_LOW)
+		core->num_inflight_low--;
+}
+
+/* fails every command in flight, their responses can no longer be told apart */
+static void ccp_core_timeout(struct ccp_core *core)
+{
+	struct ccp_cmd *cmd, *tmp;
+
+	lockdep_assert_held(&core->lock);
+
+	list_for_each_entry_safe(cmd, tmp, &core->inflight, node) {
+		ccp_core_retire(core, cmd);
+		/* how long it waited, raw_cmd reports it for a timeout */
+		cmd->latency = ktime_sub(ktime_get(), cmd->sent);
+		core->stats.timeouts++;
+		ccp_core_capture(core, CCP_CAPTURE_TIMEOUT, cmd->seq, -ETIMEDOUT, NULL, 0);
+		ccp_core_finish(core, cmd, -ETIMEDOUT);
+	}
+}
+
+static void ccp_core_send(struct ccp_core *core, struct ccp_cmd *cmd)
+{
+	int ret;
+
+	list_move_tail(&cmd->node, &core->inflight);
+	cmd->batch->unsent--;
+	if (cmd->batch->atomic)
+		core->atomic = cmd->batch->unsent ? cmd->batch : NULL;
+	core->num_inflight++;
+	if (cmd->prio == CCP_PRIO_LOW)
+		core->num_inflight_low++;
+	core->stats.inflight_max = max(core->stats.inflight_max, core->num_inflight);
+	core->stats.commands++;
+	memcpy(core->out_buffer, cmd->out, CCP_OUT_BUFFER_SIZE);
+	cmd->seq = core->stats.commands;
+	cmd->sending = true;
+	cmd->sent = ktime_get();
+	ccp_core_capture(core, CCP_CAPTURE_TX, cmd->seq, 0, cmd->out, CCP_OUT_BUFFER_SIZE);
+	spin_unlock_bh(&core->lock);
+
+	if (ccp_core_fault_output(core))
+		ret = -EIO;
+	else
+		ret = hid_hw_output_report(core->hdev, core->out_buffer, CCP_OUT_BUFFER_SIZE);
+
+	spin_lock_bh(&core->lock);
+	cmd->sending = false;
+	if (ret < 0) {
+		core->stats.output_errors++;
+		ccp_core_capture(core, CCP_CAPTURE_ERROR, cmd->seq, ret, NULL, 0);
+		/* a response matched to it belonged to someone else */
+		if (!cmd->answered)
+			ccp_core_retire(core, cmd);
+		cmd->latency = ktime_sub(ktime_get(), cmd->sent);
+		ccp_core_finish(core, cmd, ret);
+	} else if (cmd->answered) {
+		ccp_core_finish(core, cmd, 0);
+	}
+}
+
+/* low priority commands may fill half of the depth, but at least one slot */
+static bool ccp_core_low_room(struct ccp_core *core)
+{
+	return READ_ONCE(core->num_inflight_low) < max(READ_ONCE(core->depth) / 2, 1);
+}
+
+static bool ccp_core_expired(const struct ccp_cmd *cmd, ktime_t now)
+{
+	return cmd->deadline && ktime_after(now, cmd->deadline);
+}
+
+/* fails all commands of a batch, none of them has been sent */
+static void ccp_core_drop_batch(struct ccp_core *core, struct ccp_batch *batch, int prio)
+{
+	struct ccp_cmd *cmd, *tmp;
+
+	list_for_each_entry_safe(cmd, tmp, &core->queue[prio], node) {
+		if (cmd->batch != batch)
+			continue;
+		list_del(&cmd->node);
+		core->stats.deadline_dropped++;
+		ccp_core_finish(core, cmd, -ETIME);
+	}
+}
+
+/* fails the unsent batches with a queued command whose deadline has passed */
+static void ccp_core_drop_expired(struct ccp_core *core)
+{
+	struct ccp_cmd *cmd;
+	ktime_t now = ktime_get();
+	int prio;
+
+	lockdep_assert_held(&core->lock);
+
+	for (prio = 0; prio < CCP_NUM_PRIO; prio++) {
+restart:
+		list_for_each_entry(cmd, &core->queue[prio], node) {
+			/* the queue is sorted, commands after it are due later */
+			if (!ccp_core_expired(cmd, now))
+				break;
+			/* the rest of a started batch is sent late rather than cut off */
+			if (cmd->batch->unsent != cmd->batch->count)
+				continue;
+			ccp_core_drop_batch(core, cmd->batch, prio);
+			goto restart;
+		}
+	}
+}
+
+/* next command to send, NULL if there is none or no room for it */
+static struct ccp_cmd *ccp_core_next(struct ccp_core *core)
+{
+	struct ccp_cmd *cmd;
+
+	lockdep_assert_held(&core->lock);
+
+	if (core->num_inflight >= core->depth)
+		return NULL;
+	ccp_core_drop_expired(core);
+	if (core->atomic) {
+		list_for_each_entry(cmd, &core->queue[CCP_PRIO_NORMAL], node)
+			if (cmd->batch == core->atomic)
+				return cmd;
+	}
+	if (!list_empty(&core->queue[CCP_PRIO_NORMAL]))
+		return list_first_entry(&core->queue[CCP_PRIO_NORMAL], struct ccp_cmd, node);
+	if (ccp_core_low_room(core))
+		return list_first_entry_or_null(&core->queue[CCP_PRIO_LOW], struct ccp_cmd,
+						node);
+	return NULL;
+}
+
+/* a response arrived or there is room for a queued command */
+static bool ccp_core_wakeup(struct ccp_core *core, unsigned int rx_gen)
+{
+	return READ_ONCE(core->rx_gen) != rx_gen ||
+	       (READ_ONCE(core->num_inflight) < READ_ONCE(core->depth) &&
+		(!list_empty(&core->queue[CCP_PRIO_NORMAL]) ||
+		 (ccp_core_low_room(core) && !list_empty(&core->queue[CCP_PRIO_LOW]))));
+}
+
+static void ccp_core_work(struct work_struct *work)
+{
+	struct ccp_core *core = container_of(work, struct ccp_core, work);
+	struct ccp_cmd *cmd;
+	unsigned int rx_gen;
+	s64 elapsed;
+	long t;
+
+	spin_lock_bh(&core->lock);
+	for (;;) {
+		while ((cmd = ccp_core_next(core)))
+			ccp_core_send(core, cmd);
+
+		cmd = list_first_entry_or_null(&core->inflight, struct ccp_cmd, node);
+		if (!cmd)
+			break;
+
+		/* cmd may complete and go away as soon as the lock is dropped */
+		rx_gen = core->rx_gen;
+		elapsed = ktime_ms_delta(ktime_get(), cmd->sent);
+		spin_unlock_bh(&core->lock);
+
+		t = elapsed < CCP_REQ_TIMEOUT ? msecs_to_jiffies(CCP_REQ_TIMEOUT - elapsed) : 0;
+		t = wait_event_timeout(core->wait, ccp_core_wakeup(core, rx_gen), t);
+
+		spin_lock_bh(&core->lock);
+		if (!t && core->rx_gen == rx_gen)
+			ccp_core_timeout(core);
+	}
+	spin_unlock_bh(&core->lock);
+}
+
+/* matches a response to the oldest command in flight */
+static void ccp_core_match(struct ccp_core *core, const u8 *data, int size)
+{
+	struct ccp_cmd *cmd;
+	u64 latency;
+
+	lockdep_assert_held(&core->lock);
+
+	cmd = list_first_entry_or_null(&core->inflight, struct ccp_cmd, node);
+	if (!cmd) {
+		ccp_core_capture(core, CCP_CAPTURE_RX, 0, 0, data,
+				 clamp_val(size, 0, CCP_IN_BUFFER_SIZE));
+		return;
+	}
+
+	ccp_core_retire(core, cmd);
+	core->rx_gen++;
+
+	/* only copy buffer when requested */
+	memcpy(cmd->in, data, min(CCP_IN_BUFFER_SIZE, size));
+	cmd->latency = ktime_sub(ktime_get(), cmd->sent);
+	ccp_core_fault_reply(core, cmd);
+	ccp_core_capture(core, CCP_CAPTURE_RX, cmd->seq, 0, cmd->in, CCP_IN_BUFFER_SIZE);
+
+	latency = ktime_to_ns(cmd->latency);
+	core->stats.latency_ns += latency;
+	core->stats.latency_max_ns = max(core->stats.latency_max_ns, latency);
+	if (cmd->in[0])
+		core->stats.device_errors++;
+	if (ccp_core_expired(cmd, ktime_get()))
+		core->stats.deadline_late++;
+
+	/* the sender finishes it when hid_hw_output_report() returns */
+	if (cmd->sending)
+		cmd->answered = true;
+	else
+		ccp_core_finish(core, cmd, 0);
+
+	wake_up(&core->wait);
+}
+
+/* called from the raw_event callback of the driver */
+void ccp_core_raw_event(struct ccp_core *core, const u8 *data, int size)
+{
+	spin_lock(&core->lock);
+	if (!ccp_core_fault_rx(core, data, size))
+		ccp_core_match(core, data, size);
+	spin_unlock(&core->lock);
+}
+EXPORT_SYMBOL_GPL(ccp_core_raw_event);
+
+void ccp_cmd_init(struct ccp_cmd *cmd, u8 command, u8 byte1, u8 byte2, u8 byte3)
+{
+	memset(cmd->out, 0x00, CCP_OUT_BUFFER_SIZE);
+	cmd->out[0] = command;
+	cmd->out[1] = byte1;
+	cmd->out[2] = byte2;
+	cmd->out[3] = byte3;
+	cmd->deadline = 0;
+}
+EXPORT_SYMBOL_GPL(ccp_cmd_init);
+
+/* queues a command behind all commands due no later than it */
+static void ccp_core_enqueue(struct ccp_core *core, struct ccp_cmd *cmd)
+{
+	struct list_head *queue = &core->queue[cmd->prio];
+	ktime_t due = cmd->deadline ?: KTIME_MAX;
+	struct ccp_cmd *pos;
+
+	list_for_each_entry_reverse(pos, queue, node) {
+		if (ktime_compare(pos->deadline ?: KTIME_MAX, due) <= 0)
+			break;
+	}
+	list_add(&cmd->node, &pos->node);
+}
+
+/*
+ * Queue count commands and wait until all of them are answered or failed. The result of
+ * each command is in its status and in fields. With a depth above one the commands are
+ * sent back to back, so a batch costs about one round trip instead of one per command.
+ * Commands of one priority are sent by deadline, then in submission order. If a deadline
+ * passes before any of the commands is sent, all of them fail with -ETIME.
+ */
+static void ccp_core_submit_batch(struct ccp_core *core, struct ccp_cmd *cmds, int count,
+				  enum ccp_prio prio, bool atomic)
+{
+	struct ccp_batch batch;
+	int i;
+
+	if (!count)
+		return;
+
+	init_completion(&batch.done);
+	batch.count = count;
+	batch.pending = count;
+	batch.unsent = count;
+	batch.atomic = atomic;
+
+	spin_lock_bh(&core->lock);
+	for (i = 0; i < count; i++) {
+		cmds[i].batch = &batch;
+		cmds[i].status = 0;
+		cmds[i].sending = false;
+		cmds[i].answered = false;
+		/* stays 0 for commands dropped unsent */
+		cmds[i].latency = 0;
+		cmds[i].prio = prio;
+		ccp_core_enqueue(core, &cmds[i]);
+	}
+	spin_unlock_bh(&core->lock);
+
+	/* the worker may be waiting for a response with room left in flight */
+	wake_up(&core->wait);
+	queue_work(core->wq, &core->work);
+	wait_for_completion(&batch.done);
+}
+
+int ccp_core_submit_prio(struct ccp_core *core, struct ccp_cmd *cmds, int count,
+			 enum ccp_prio prio)
+{
+	ccp_core_submit_batch(core, cmds, count, prio, false);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(ccp_core_submit_prio);
+
+/*
+ * Like ccp_core_submit(), but no other command is sent between the first and the last
+ * frame of the batch. Deadlines are ignored, the batch is never cut short.
+ */
+int ccp_core_submit_atomic(struct ccp_core *core, struct ccp_cmd *cmds, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		cmds[i].deadline = 0;
+	ccp_core_submit_batch(core, cmds, count, CCP_PRIO_NORMAL, true);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(ccp_core_submit_atomic);
+
+int ccp_core_submit(struct ccp_core *core, struct ccp_cmd *cmds, int count)
+{
+	return ccp_core_submit_prio(core, cmds, count, CCP_PRIO_NORMAL);
+}
+EXPORT_SYMBOL_GPL(ccp_core_submit);
+
+/* send one command, response is not checked for device errors */
+int ccp_core_xfer(struct ccp_core *core, struct ccp_cmd *cmd)
+{
+	ccp_core_submit(core, cmd, 1);
+
+	return cmd->status;
+}
+EXPORT_SYMBOL_GPL(ccp_core_xfer);
+
+/* converts response error in the response to errno */
+int ccp_core_errno(struct ccp_core *core, const struct ccp_cmd *cmd)
+{
+	switch (cmd->in[0]) {
+	case 0x00: /* success */
+		return 0;
+	case 0x01: /* called invalid command */
+		return -EOPNOTSUPP;
+	case 0x10: /* called GET_VOLT / GET_TMP with invalid arguments */
+		return -EINVAL;
+	case 0x11: /* requested temps of disconnected sensors */
+	case 0x12: /* requested pwm of not pwm controlled channels */
+		return -ENODATA;
+	default:
+		hid_dbg(core->hdev, "unknown device response error: %d", cmd->in[0]);
+		return -EIO;
+	}
+}
+EXPORT_SYMBOL_GPL(ccp_core_errno);
+
+void ccp_core_set_depth(struct ccp_core *core, int depth)
+{
+	spin_lock_bh(&core->lock);
+	core->depth = clamp_val(depth, 1, CCP_MAX_INFLIGHT);
+	spin_unlock_bh(&core->lock);
+}
+EXPORT_SYMBOL_GPL(ccp_core_set_depth);
+
+/*
+ * Writing up to CCP_OUT_BUFFER_SIZE bytes sends them as one command frame, zero padded.
+ * Reading returns the transfer status, the round trip time in ns and the raw response
+ * of the last frame. The response is not checked for device errors, so tools can
+ * tell invalid commands (0x01 in byte 0) from data.
+ */
+static ssize_t raw_cmd_write(struct file *file, const char __user *ubuf,
+			     size_t count, loff_t *ppos)
+{
+	struct ccp_core *core = file->private_data;
+	int ret;
+
+	if (!count || count > CCP_OUT_BUFFER_SIZE)
+		return -EINVAL;
+
+	mutex_lock(&core->raw_mutex);
+
+	memset(core->raw.out, 0x00, CCP_OUT_BUFFER_SIZE);
+	if (copy_from_user(core->raw.out, ubuf, count)) {
+		ret = -EFAULT;
+		goto out_unlock;
+	}
+
+	if (ccp_core_xfer(core, &core->raw))
+		memset(core->raw.in, 0x00, CCP_IN_BUFFER_SIZE);
+
+	ret = count;
+
+out_unlock:
+	mutex_unlock(&core->raw_mutex);
+	return ret;
+}
+
+static ssize_t raw_cmd_read(struct file *file, char __user *ubuf,
+			    size_t count, loff_t *ppos)
+{
+	struct ccp_core *core = file->private_data;
+	char buf[32 + 3 * CCP_IN_BUFFER_SIZE];
+	int len;
+
+	mutex_lock(&core->raw_mutex);
+	len = scnprintf(buf, sizeof(buf), "%d %lld %*ph\n",
+			core->raw.status, ktime_to_ns(core->raw.latency),
+			CCP_IN_BUFFER_SIZE, core->raw.in);
+	mutex_unlock(&core->raw_mutex);
+
+	return simple_read_from_buffer(ubuf, count, ppos, buf, len);
+}
+
+/* CCP_IOC_BATCH: one atomic batch of frames, all responses are copied back at once */
+static long raw_cmd_batch(struct ccp_core *core, struct ccp_batch_req __user *ureq)
+{
+	struct ccp_batch_cmd __user *ucmds;
+	struct ccp_batch_cmd *bcmds;
+	struct ccp_batch_req req;
+	struct ccp_cmd *cmds;
+	long ret = 0;
+	int i;
+
+	if (copy_from_user(&req, ureq, sizeof(req)))
+		return -EFAULT;
+	if (!req.count || req.count > CCP_BATCH_MAX || req.flags)
+		return -EINVAL;
+
+	ucmds = u64_to_user_ptr(req.cmds);
+	bcmds = memdup_user(ucmds, req.count * sizeof(*bcmds));
+	if (IS_ERR(bcmds))
+		return PTR_ERR(bcmds);
+
+	cmds = kcalloc(req.count, sizeof(*cmds), GFP_KERNEL);
+	if (!cmds) {
+		ret = -ENOMEM;
+		goto out_free_bcmds;
+	}
+
+	for (i = 0; i < req.count; i++)
+		memcpy(cmds[i].out, bcmds[i].out, CCP_OUT_BUFFER_SIZE);
+
+	ccp_core_submit_atomic(core, cmds, req.count);
+
+	for (i = 0; i < req.count; i++) {
+		if (cmds[i].status)
+			memset(cmds[i].in, 0x00, CCP_IN_BUFFER_SIZE);
+		memcpy(bcmds[i].in, cmds[i].in, CCP_IN_BUFFER_SIZE);
+		bcmds[i].status = cmds[i].status;
+		bcmds[i].latency_ns = cmds[i].status ? 0 : ktime_to_ns(cmds[i].latency);
+	}
+
+	if (copy_to_user(ucmds, bcmds, req.count * sizeof(*bcmds)))
+		ret = -EFAULT;
+
+	kfree(cmds);
+out_free_bcmds:
+	kfree(bcmds);
+	return ret;
+}
+
+static long raw_cmd_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct ccp_core *core = file->private_data;
+
+	switch (cmd) {
+	case CCP_IOC_BATCH:
+		return raw_cmd_batch(core, (struct ccp_batch_req __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+static const struct file_operations raw_cmd_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.read = raw_cmd_read,
+	.write = raw_cmd_write,
+	.unlocked_ioctl = raw_cmd_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+	.llseek = default_llseek,
+};
+
+static const char * const ccp_capture_names[] = {
+	[CCP_CAPTURE_TX] = "tx",
+	[CCP_CAPTURE_RX] = "rx",
+	[CCP_CAPTURE_TIMEOUT] = "timeout",
+	[CCP_CAPTURE_ERROR] = "error",
+};
+
+/*
+ * Reading drains the capture log, one line per record:
+ * "<time ns> <seq> <tx|rx|timeout|error> <status> <bytes>", frames without trailing
+ * zeros. Writing 1 starts capturing into an empty log, 0 stops and frees it.
+ */
+static ssize_t capture_read(struct file *file, char __user *ubuf,
+			    size_t count, loff_t *ppos)
+{
+	struct ccp_core *core = file->private_data;
+	struct ccp_capture_rec rec;
+	char line[64 + 3 * CCP_OUT_BUFFER_SIZE];
+	ssize_t done = 0;
+	int len;
+
+	mutex_lock(&core->capture_mutex);
+
+	while (done < count) {
+		spin_lock_bh(&core->lock);
+		if (!core->capture || core->capture_read == core->capture_written) {
+			spin_unlock_bh(&core->lock);
+			break;
+		}
+		if (core->capture_written - core->capture_read > CCP_CAPTURE_SIZE)
+			core->capture_read = core->capture_written - CCP_CAPTURE_SIZE;
+		rec = core->capture[core->capture_read % CCP_CAPTURE_SIZE];
+		spin_unlock_bh(&core->lock);
+
+		while (rec.len > 1 && !rec.data[rec.len - 1])
+			rec.len--;
+		len = scnprintf(line, sizeof(line), "%lld %u %s %d %*ph\n",
+				ktime_to_ns(rec.time), rec.seq, ccp_capture_names[rec.type],
+				rec.status, rec.len, rec.data);
+		if (len > count - done) {
+			if (!done)
+				done = -EINVAL;
+			break;
+		}
+		if (copy_to_user(ubuf + done, line, len)) {
+			done = -EFAULT;
+			break;
+		}
+		done += len;
+
+		spin_lock_bh(&core->lock);
+		core->capture_read++;
+		spin_unlock_bh(&core->lock);
+	}
+
+	mutex_unlock(&core->capture_mutex);
+	return done;
+}
+
+static ssize_t capture_write(struct file *file, const char __user *ubuf,
+			     size_t count, loff_t *ppos)
+{
+	struct ccp_core *core = file->private_data;
+	struct ccp_capture_rec *capture = NULL;
+	bool enable;
+	int ret;
+
+	ret = kstrtobool_from_user(ubuf, count, &enable);
+	if (ret)
+		return ret;
+
+	if (enable) {
+		capture = vmalloc(array_size(CCP_CAPTURE_SIZE, sizeof(*capture)));
+		if (!capture)
+			return -ENOMEM;
+	}
+
+	mutex_lock(&core->capture_mutex);
+	spin_lock_bh(&core->lock);
+	swap(core->capture, capture);
+	core->capture_written = 0;
+	core->capture_read = 0;
+	spin_unlock_bh(&core->lock);
+	mutex_unlock(&core->capture_mutex);
+
+	vfree(capture);
+	return count;
+}
+
+static const struct file_operations capture_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.read = capture_read,
+	.write = capture_write,
+};
+
+static int stats_show(struct seq_file *seqf, void *unused)
+{
+	struct ccp_core *core = seqf->private;
+	struct ccp_stats stats;
+	u64 answered;
+	int depth;
+
+	spin_lock_bh(&core->lock);
+	stats = core->stats;
+	depth = core->depth;
+	spin_unlock_bh(&core->lock);
+
+	answered = stats.commands - stats.timeouts - stats.output_errors;
+
+	seq_printf(seqf, "depth %d\n", depth);
+	seq_printf(seqf, "commands %llu\n", stats.commands);
+	seq_printf(seqf, "timeouts %llu\n", stats.timeouts);
+	seq_printf(seqf, "output_errors %llu\n", stats.output_errors);
+	seq_printf(seqf, "device_errors %llu\n", stats.device_errors);
+	seq_printf(seqf, "latency_avg_us %llu\n",
+		   answered ? div64_u64(stats.latency_ns, answered) / NSEC_PER_USEC : 0);
+	seq_printf(seqf, "latency_max_us %llu\n", stats.latency_max_ns / NSEC_PER_USEC);
+	seq_printf(seqf, "inflight_max %d\n", stats.inflight_max);
+	seq_printf(seqf, "capture_dropped %llu\n", stats.capture_dropped);
+	seq_printf(seqf, "faults %llu\n", stats.faults);
+	seq_printf(seqf, "deadline_dropped %llu\n", stats.deadline_dropped);
+	seq_printf(seqf, "deadline_late %llu\n", stats.deadline_late);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats);
+
+void ccp_core_debugfs_init(struct ccp_core *core, struct dentry *dir)
+{
+	debugfs_create_file("raw_cmd", 0600, dir, core, &raw_cmd_fops);
+	debugfs_create_file("stats", 0444, dir, core, &stats_fops);
+	debugfs_create_file("capture", 0600, dir, core, &capture_fops);
+	ccp_core_fault_debugfs_init(core, dir);
+}
+EXPORT_SYMBOL_GPL(ccp_core_debugfs_init);
+
+int ccp_core_init(struct ccp_core *core, struct hid_device *hdev)
+{
+	core->hdev = hdev;
+	core->depth = 1;
+
+	core->out_buffer = devm_kmalloc(&hdev->dev, CCP_OUT_BUFFER_SIZE, GFP_KERNEL);
+	if (!core->out_buffer)
+		return -ENOMEM;
+
+	core->wq = alloc_ordered_workqueue("ccp-%s", WQ_HIGHPRI | WQ_MEM_RECLAIM,
+					   dev_name(&hdev->dev));
+	if (!core->wq)
+		return -ENOMEM;
+
+	INIT_WORK(&core->work, ccp_core_work);
+	init_waitqueue_head(&core->wait);
+	spin_lock_init(&core->lock);
+	INIT_LIST_HEAD(&core->queue[CCP_PRIO_NORMAL]);
+	INIT_LIST_HEAD(&core->queue[CCP_PRIO_LOW]);
+	INIT_LIST_HEAD(&core->inflight);
+	mutex_init(&core->raw_mutex);
+	mutex_init(&core->capture_mutex);
+	ccp_core_fault_init(core);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(ccp_core_init);
+
+/* no command may be submitted anymore, queued ones are still answered or failed */
+void ccp_core_destroy(struct ccp_core *core)
+{
+	ccp_core_fault_destroy(core);
+	destroy_workqueue(core->wq);
+	vfree(core->capture);
+}
+EXPORT_SYMBOL_GPL(ccp_core_destroy);
+
+MODULE_DESCRIPTION("Transport for Corsair fan and led controllers");
+MODULE_LICENSE("GPL");
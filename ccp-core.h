@@ -0,0 +1,144 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * ccp-core.h - transport for Corsair controllers using 63 byte commands and 16 byte responses
+ * Copyright (C) 2020 Marius Zachmann <mail@mariuszachmann.de>
+ */
+
+#ifndef _CCP_CORE_H
+#define _CCP_CORE_H
+
+#include <linux/completion.h>
+#include <linux/fault-inject.h>
+#include <linux/hid.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+
+#define CCP_OUT_BUFFER_SIZE	63
+#define CCP_IN_BUFFER_SIZE	16
+#define CCP_REQ_TIMEOUT		300	/* in ms */
+#define CCP_MAX_INFLIGHT	8
+#define CCP_CAPTURE_SIZE	1024	/* records kept by the debugfs capture log */
+#define CCP_FAULT_DELAY_SLOTS	(2 * CCP_MAX_INFLIGHT)	/* responses held back at once */
+
+struct ccp_batch;
+
+/* queues of the worker, lower values are sent first */
+enum ccp_prio {
+	CCP_PRIO_NORMAL,	/* sensors and fan control */
+	CCP_PRIO_LOW,		/* bulk traffic, only uses half of the depth */
+	CCP_NUM_PRIO,
+};
+
+/* one command frame and its response */
+struct ccp_cmd {
+	u8 out[CCP_OUT_BUFFER_SIZE];
+	u8 in[CCP_IN_BUFFER_SIZE];
+	int status;		/* transfer result, device errors in in[0] are not checked */
+	ktime_t latency;	/* from sending the frame to its response or failure, 0 if unsent */
+	ktime_t deadline;	/* the response is useless after it, 0 for none */
+
+	/* private to ccp-core, protected by ccp_core.lock */
+	struct list_head node;
+	struct ccp_batch *batch;
+	u32 seq;		/* number of the frame, ties capture records together */
+	enum ccp_prio prio;
+	ktime_t sent;
+	bool sending;
+	bool answered;
+};
+
+struct ccp_stats {
+	u64 commands;		/* frames sent */
+	u64 timeouts;		/* commands without response */
+	u64 output_errors;	/* frames the hid layer failed to send */
+	u64 device_errors;	/* responses with an error code */
+	u64 latency_ns;		/* sum of all round trips */
+	u64 latency_max_ns;
+	u64 capture_dropped;	/* capture records overwritten before being read */
+	u64 faults;		/* injected faults */
+	u64 deadline_dropped;	/* commands failed unsent because their deadline passed */
+	u64 deadline_late;	/* responses arriving after the deadline */
+	int inflight_max;
+};
+
+enum ccp_capture_type {
+	CCP_CAPTURE_TX,		/* frame sent */
+	CCP_CAPTURE_RX,		/* response, seq 0 if no command was in flight */
+	CCP_CAPTURE_TIMEOUT,	/* command failed without response */
+	CCP_CAPTURE_ERROR,	/* hid layer failed to send the frame */
+};
+
+/* response held back by fault injection */
+struct ccp_fault_delayed {
+	u8 data[CCP_IN_BUFFER_SIZE];
+	int size;
+	ktime_t due;
+};
+
+struct ccp_capture_rec {
+	ktime_t time;
+	u32 seq;
+	u8 type;
+	u8 len;
+	int status;
+	u8 data[CCP_OUT_BUFFER_SIZE];
+};
+
+struct ccp_core {
+	struct hid_device *hdev;
+	struct workqueue_struct *wq;
+	struct work_struct work;
+	wait_queue_head_t wait;		/* woken by every response */
+	spinlock_t lock;
+	struct list_head queue[CCP_NUM_PRIO];	/* submitted, not sent yet */
+	struct list_head inflight;	/* sent, responses arrive in this order */
+	struct ccp_batch *atomic;	/* atomic batch partly sent, nothing else goes out */
+	int num_inflight;
+	int num_inflight_low;		/* CCP_PRIO_LOW commands in flight */
+	int depth;			/* commands allowed in flight */
+	unsigned int rx_gen;		/* incremented by every matched response */
+	u8 *out_buffer;			/* frames must not be sent from the stack */
+	struct ccp_stats stats;
+	/* debugfs raw_cmd */
+	struct mutex raw_mutex;
+	struct ccp_cmd raw;
+	/* debugfs capture, ring of CCP_CAPTURE_SIZE records or NULL */
+	struct mutex capture_mutex;	/* serializes readers and enabling */
+	struct ccp_capture_rec *capture;
+	u64 capture_written;
+	u64 capture_read;
+#ifdef CONFIG_FAULT_INJECTION_DEBUG_FS
+	struct fault_attr fail_output;		/* frame is not sent */
+	struct fault_attr fail_drop;		/* response is dropped */
+	struct fault_attr fail_delay;		/* response is held back by fail_delay_ms */
+	struct fault_attr fail_device_error;	/* response byte 0 is fail_error_code */
+	u32 fail_delay_ms;
+	u8 fail_error_code;
+	/* delayed responses, later ones wait behind them to keep the order */
+	struct delayed_work fault_work;
+	struct ccp_fault_delayed delayed[CCP_FAULT_DELAY_SLOTS];
+	int delayed_head;
+	int delayed_count;
+#endif
+};
+
+int ccp_core_init(struct ccp_core *core, struct hid_device *hdev);
+void ccp_core_destroy(struct ccp_core *core);
+void ccp_core_set_depth(struct ccp_core *core, int depth);
+void ccp_core_raw_event(struct ccp_core *core, const u8 *data, int size);
+void ccp_core_debugfs_init(struct ccp_core *core, struct dentry *dir);
+
+void ccp_cmd_init(struct ccp_cmd *cmd, u8 command, u8 byte1, u8 byte2, u8 byte3);
+int ccp_core_submit(struct ccp_core *core, struct ccp_cmd *cmds, int count);
+int ccp_core_submit_prio(struct ccp_core *core, struct ccp_cmd *cmds, int count,
+			 enum ccp_prio prio);
+int ccp_core_submit_atomic(struct ccp_core *core, struct ccp_cmd *cmds, int count);
+int ccp_core_xfer(struct ccp_core *core, struct ccp_cmd *cmd);
+int ccp_core_errno(struct ccp_core *core, const struct ccp_cmd *cmd);
+
+#endif
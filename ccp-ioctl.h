@@ -0,0 +1,31 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later WITH Linux-syscall-note */
+/*
+ * ccp-ioctl.h - ioctl of the ccp-core debugfs raw_cmd file
+ * Copyright (C) 2020 Marius Zachmann <mail@mariuszachmann.de>
+ */
+
+#ifndef _CCP_IOCTL_H
+#define _CCP_IOCTL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define CCP_BATCH_MAX	64	/* commands per CCP_IOC_BATCH */
+
+struct ccp_batch_cmd {
+	__u8 out[64];		/* command frame, the first 63 bytes are sent */
+	__u8 in[16];		/* response, not checked for device errors */
+	__s32 status;		/* 0 or negative errno of the transfer */
+	__u32 latency_ns;	/* from sending the frame to its response */
+};
+
+struct ccp_batch_req {
+	__u64 cmds;		/* pointer to count struct ccp_batch_cmd */
+	__u32 count;
+	__u32 flags;		/* must be 0 */
+};
+
+/* sends the frames back to back, no other command is sent between them */
+#define CCP_IOC_BATCH	_IOW(0xcc, 0x01, struct ccp_batch_req)
+
+#endif
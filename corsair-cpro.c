@@ -1,34 +1,47 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 /*
- * corsair-cpro.c - Linux driver for Corsair Commander Pro
+ * corsair-cpro.c - Linux driver for Corsair Commander Pro and Lighting Node controllers
  * Copyright (C) 2020 Marius Zachmann <mail@mariuszachmann.de>
  *
  * This driver uses hid reports to communicate with the device to allow hidraw userspace drivers
  * still being used. The device does not use report ids. When using hidraw and this driver
- * simultaniously, reports could be switched.
+ * simultaniously, reports could be switched. The transport is in ccp-core.c, this file
+ * describes the devices and implements hwmon on top of it.
  */
 
+#include <linux/atomic.h>
 #include <linux/bitops.h>
-#include <linux/completion.h>
 #include <linux/debugfs.h>
+#include <linux/fs.h>
 #include <linux/hid.h>
 #include <linux/hwmon.h>
+#include <linux/hwmon-sysfs.h>
+#include <linux/idr.h>
 #include <linux/kernel.h>
+#include <linux/list.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
+#include <linux/perf_event.h>
 #include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/sysfs.h>
 #include <linux/types.h>
+#include <linux/unaligned.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+
+#include "ccp-core.h"
 
 #define USB_VENDOR_ID_CORSAIR			0x1b1c
 #define USB_PRODUCT_ID_CORSAIR_COMMANDERPRO	0x0c10
 #define USB_PRODUCT_ID_CORSAIR_1000D		0x1d00
+#define USB_PRODUCT_ID_CORSAIR_LNP		0x0c0b
+#define USB_PRODUCT_ID_CORSAIR_LN_CORE		0x0c1a
 
-#define OUT_BUFFER_SIZE		63
-#define IN_BUFFER_SIZE		16
 #define LABEL_LENGTH		11
-#define REQ_TIMEOUT		300
+#define SENSOR_CACHE_TIME	HZ	/* in jiffies */
 
 #define CTL_GET_FW_VER		0x02	/* returns the firmware version in bytes 1-3 */
 #define CTL_GET_BL_VER		0x06	/* returns the bootloader version in bytes 1-2 */
@@ -75,466 +88,3845 @@
 					 * send: byte 2-3 is target
 					 * device accepts all values from 0x00 - 0xFFFF
 					 */
+#define CTL_SET_FAN_CURVE	0x25	/*
+					 * set fan curve, the device controls the fan speed
+					 * send: byte 1 is fan number
+					 * send: byte 2 is temp sensor number
+					 * send: byte 3-14 are 6 temperatures in centi-degree
+					 *	 celsius, 2 bytes each
+					 * send: byte 15-26 are the 6 target rpm values
+					 */
+#define CTL_SET_LED_DIRECT	0x32	/*
+					 * set led colors of one color component
+					 * send: byte 1 is led channel
+					 * send: byte 2 is first led, byte 3 led count (max 50)
+					 * send: byte 4 is component: 0 red, 1 green, 2 blue
+					 * send: byte 5 on are the values
+					 */
+#define CTL_LED_COMMIT		0x33	/*
+					 * show the colors set by CTL_SET_LED_DIRECT
+					 * send: byte 1 is 0xff
+					 */
+#define CTL_SET_LED_PORT_STATE	0x38	/*
+					 * send: byte 1 is led channel
+					 * send: byte 2 is 1 for device effects,
+					 *	 2 for colors set by the host
+					 */
 
 #define NUM_FANS		6
 #define NUM_TEMP_SENSORS	4
+#define NUM_VOLTS		3
+#define NUM_SENSORS		(NUM_FANS + NUM_TEMP_SENSORS + NUM_VOLTS)
+#define NUM_CURVE_POINTS	6
+#define NUM_VIRT_CHANNELS	2	/* virtual temp and fan channels each */
+#define NUM_VIRT_SOURCES	6
+#define NUM_LED_CHANNELS	2
+#define LED_MAX			204	/* leds per channel */
+#define LED_DIRECT_MAX		50	/* leds per CTL_SET_LED_DIRECT */
+#define LED_FPS_MAX		100
+#define LED_INDICATOR_POINTS	3
+/* port state, every component in full frames and the commit */
+#define LED_MAX_CMDS		(3 * DIV_ROUND_UP(LED_MAX, LED_DIRECT_MAX) + 2)
+
+/*
+ * Commands and fast paths which are not safe with every firmware. No firmware version is
+ * known to draw a line between them, so they are not looked up by version: a device starts
+ * with the caps of its type, and the first CTL_SET_FAN_CURVE the firmware rejects as an
+ * invalid command clears CCP_CAP_FAN_CURVE. Later curve requests then fail with
+ * -EOPNOTSUPP without a round trip.
+ */
+#define CCP_CAP_BATCH		BIT(0)	/* several commands may be in flight */
+#define CCP_CAP_FAN_CURVE	BIT(1)	/* device side fan curves */
+#define CCP_CAP_LED		BIT(2)	/* direct led color uploads */
+
+static const char * const ccp_cap_names[] = {
+	"batch", "fan_curve", "led",
+};
+
+/*
+ * No firmware version is known to keep several commands in flight apart, so it is off
+ * until a device checked with tools/ccp-opscan turns it on.
+ */
+static bool batch;
+module_param(batch, bool, 0444);
+MODULE_PARM_DESC(batch, "Keep several commands in flight (default: off)");
+
+/* per device type data, driver_data of ccp_devices[] */
+struct ccp_device_info {
+	const char *hwmon_name;	/* NULL if the device has no sensors */
+	unsigned long caps;	/* before probing the firmware */
+};
+
+/* fan curve of one channel, sent to the device when pwm_enable is 2 */
+struct ccp_fan_curve {
+	u8 sensor;
+	int temp[NUM_CURVE_POINTS];	/* in millidegree celsius */
+	u16 rpm[NUM_CURVE_POINTS];
+};
+
+/* how a virtual channel combines its sources */
+enum ccp_virt_op {
+	CCP_VIRT_NONE,
+	CCP_VIRT_DIFF,		/* first source minus second */
+	CCP_VIRT_MAX,
+	CCP_VIRT_MIN,
+	CCP_VIRT_AVG,
+	CCP_VIRT_SUM,		/* weighted sum */
+};
+
+static const char * const ccp_virt_ops[] = {
+	"none", "diff", "max", "min", "avg", "sum",
+};
+
+/* virtual channel computed from cached readings of physical channels */
+struct ccp_virt {
+	enum ccp_virt_op op;
+	int count;
+	u8 src[NUM_VIRT_SOURCES];	/* physical channel, starting at 0 */
+	int weight[NUM_VIRT_SOURCES];	/* in thousandths */
+};
+
+/* colors last sent to one led channel, by component */
+struct ccp_led_channel {
+	u8 shadow[3][LED_MAX];
+	int count;		/* leds in shadow, 0 if it has to be sent in full */
+	bool direct;		/* port is in CTL_SET_LED_PORT_STATE mode 2 */
+};
+
+struct ccp_led_stats {
+	u64 frames;		/* uploads */
+	u64 reports;		/* frames sent for them */
+	u64 reports_full;	/* frames sending every led would have taken */
+};
+
+/*
+ * Led streaming: writes go to the back buffer of the channel and replace a frame not
+ * uploaded yet. The work swaps it to the front buffer and uploads it, at most fps
+ * times per second.
+ */
+struct ccp_led_stream {
+	struct mutex mutex;	/* protects everything but front */
+	struct delayed_work work;
+	unsigned int fps;	/* 0 if writes are uploaded right away */
+	unsigned long last;	/* last upload in jiffies */
+	u64 dropped;		/* frames replaced before being uploaded */
+	struct {
+		u8 back[3 * LED_MAX];
+		int count;	/* leds in back, 0 if no frame is waiting */
+		u8 front[3 * LED_MAX];
+	} buf[NUM_LED_CHANNELS];
+};
+
+/* leds showing a temperature, the color is interpolated between the points */
+struct ccp_led_indicator {
+	int temp;		/* hwmon temp channel starting at 0, negative if off */
+	int count;		/* leds to color */
+	int point_temp[LED_INDICATOR_POINTS];	/* in millidegree celsius, rising */
+	u32 point_rgb[LED_INDICATOR_POINTS];	/* 0xrrggbb */
+};
+
+/*
+ * Sensor history, see ccp_history_work(). The ring consists of blocks, each starting
+ * with a full sample, so evicting the oldest block leaves the others decodable.
+ */
+#define HIST_BLOCK_SIZE		1024
+#define HIST_MAX_SIZE		(16 << 20)
+#define HIST_CHANNELS		(NUM_TEMP_SENSORS + NUM_FANS + NUM_VOLTS)
+#define HIST_RECORD_MAX		(2 + 8 + 5 + 5 + 5 * HIST_CHANNELS)
+
+struct ccp_history {
+	struct mutex mutex;
+	struct delayed_work work;
+	u8 *buf;		/* nblocks * HIST_BLOCK_SIZE, NULL if off */
+	int nblocks;
+	int head;		/* block written to */
+	int count;		/* blocks holding samples */
+	u64 samples;		/* samples stored since the size was set */
+	/* the last sample, deltas are taken against it */
+	ktime_t last_time;
+	u32 last_mask;
+	int last[HIST_CHANNELS];
+};
+
+/* convergence of fan_target, see ccp_target_work() */
+#define CCP_TARGET_TOLERANCE	100		/* default in rpm */
+#define CCP_TARGET_SETTLE	2		/* readings in tolerance in a row */
+#define CCP_TARGET_TIMEOUT	(30 * HZ)	/* gives up after it */
+
+struct ccp_target_watch {
+	int tolerance;		/* in rpm */
+	int hits;		/* readings in tolerance in a row */
+	unsigned long since;	/* jiffies of setting the target */
+	bool reached;
+};
+
+/*
+ * Trend model of a temperature channel, see ccp_estimate_update(). Temperatures are in
+ * millidegree celsius, the slope in millidegree per second times 256.
+ */
+#define PREDICT_INTERVAL_MAX	60000	/* in ms */
+#define PREDICT_RESOLUTION	5	/* half the 0.01 degree steps of the device */
+
+struct ccp_estimate {
+	bool valid;
+	int temp;		/* filtered temperature at time */
+	s64 slope;
+	unsigned long time;	/* jiffies of the last sample */
+	int interval;		/* ms between the last two samples */
+	s64 err2;		/* mean squared prediction error of the samples */
+};
+
+/* fan speed optimizer, see ccp_opt_work() */
+#define OPT_CAL_POINTS		6	/* rpm at 0, 20, ... 100 % duty */
+#define OPT_HYSTERESIS		500	/* in millidegree celsius */
+#define OPT_GAIN		4	/* millidegree per weighted rpm and second */
+#define OPT_WEIGHT_MAX		1000
+
+enum ccp_opt_mode {
+	CCP_OPT_RPM,		/* least total rpm */
+	CCP_OPT_NOISE,		/* least sum of squared rpm, spread over the fans */
+};
+
+static const char * const ccp_opt_modes[] = {
+	[CCP_OPT_RPM] = "rpm",
+	[CCP_OPT_NOISE] = "noise",
+};
+
+struct ccp_opt_fan {
+	int weight;		/* cooling per rpm in thousandths, 0 if not used */
+	bool calibrated;
+	u16 rpm[OPT_CAL_POINTS];
+	int duty;		/* last sent in percent, negative if unknown */
+};
+
+struct ccp_optimizer {
+	int temp;		/* hwmon temp channel starting at 0, negative if off */
+	int target;		/* in millidegree celsius */
+	enum ccp_opt_mode mode;
+	int effort;		/* sum of weight * rpm / 1000 the fans have to deliver */
+	bool stop;		/* set on remove */
+	struct ccp_opt_fan fans[NUM_FANS];
+	struct delayed_work work;
+};
+
+/* pwm_enable values */
+#define CCP_PWM_FULL		0
+#define CCP_PWM_MANUAL		1
+#define CCP_PWM_CURVE		2
+
+/* cached sensor reading, value is a negative errno if the device returned an error */
+struct ccp_sensor {
+	int value;
+	unsigned long updated;	/* in jiffies */
+	bool valid;
+};
+
+/* what decides if a channel is present */
+enum ccp_cnct {
+	CCP_CNCT_NONE,		/* always present */
+	CCP_CNCT_TEMP,		/* bit in temp_cnct */
+	CCP_CNCT_FAN,		/* bit in fan_cnct */
+};
+
+/* indexes into ccp_sensors[] */
+enum ccp_sensor_id {
+	CCP_TEMP_INPUT,
+	CCP_TEMP_LABEL,
+	CCP_TEMP_ENABLE,
+	CCP_FAN_INPUT,
+	CCP_FAN_ENABLE,
+	CCP_FAN_LABEL,
+	CCP_FAN_TARGET,
+	CCP_PWM_INPUT,
+	CCP_PWM_ENABLE,
+	CCP_IN_INPUT,
+	CCP_IN_ENABLE,
+	CCP_NUM_SENSOR_IDS,
+};
+
+#define CCP_MAX_CHANNELS	NUM_FANS
+
+#define CCP_SENSOR_SWEEP	BIT(0)	/* requested by every sensor sweep */
+#define CCP_SENSOR_VIRT		BIT(1)	/* also present on the virtual channels */
+
+struct ccp_device;
+
+/*
+ * Describes one hwmon attribute. Attributes with a command are read from the device
+ * and cached, the response holds width bytes big endian starting at byte 1, which are
+ * scaled by mul / div. Everything else is done by the callbacks. Attributes are only
+ * visible if the device type has all caps. Channels from channels on are virtual.
+ */
+struct ccp_sensor_desc {
+	enum hwmon_sensor_types type;
+	u32 attr;
+	u8 command;
+	u8 width;
+	int mul;
+	int div;
+	int channels;
+	enum ccp_cnct cnct;
+	umode_t mode;
+	unsigned int flags;
+	unsigned long caps;
+	int (*read)(struct ccp_device *ccp, int channel, long *val);
+	int (*read_string)(struct ccp_device *ccp, int channel, const char **str);
+	int (*write)(struct ccp_device *ccp, int channel, long val);
+};
+
+/* one read request of a sensor sweep */
+struct ccp_req {
+	const struct ccp_sensor_desc *desc;
+	u8 channel;
+	struct ccp_sensor *sensor;
+};
 
 struct ccp_device {
 	struct hid_device *hdev;
+	const struct ccp_device_info *info;
+	struct ccp_core core;
 	struct device *hwmon_dev;
 	struct dentry *debugfs;
-	/* For reinitializing the completion below */
-	spinlock_t wait_input_report_lock;
-	struct completion wait_input_report;
 	struct mutex mutex; /* whenever buffer is used, lock before send_usb_cmd */
-	u8 *cmd_buffer;
-	u8 *buffer;
+	u8 buffer[CCP_IN_BUFFER_SIZE];
+	/* requests of a sensor sweep or state restore, protected by mutex */
+	struct ccp_req sweep_reqs[NUM_SENSORS];
+	struct ccp_cmd sweep_cmds[NUM_SENSORS];
+	struct ccp_sensor sensors[CCP_NUM_SENSOR_IDS][CCP_MAX_CHANNELS];
+	/* channels switched off through *_enable, indexed by sensor id */
+	unsigned long disabled[CCP_NUM_SENSOR_IDS];
+	struct work_struct warm_work;	/* first sweep, runs while hwmon registers */
+	struct ccp_history history;
+	/* read-ahead without CCP_CAP_BATCH, ra_* protected by mutex */
+	struct work_struct readahead_work;
+	unsigned int ra_pos;		/* CCP_RA_POS of the last cache miss */
+	unsigned long ra_time;
 	int target[6];
+	int pwm_enable[NUM_FANS];	/* negative if unknown */
+	/* protected by mutex */
+	struct ccp_target_watch watch[NUM_FANS];
+	struct ccp_estimate estimate[NUM_TEMP_SENSORS];
+	struct ccp_optimizer opt;	/* protected by mutex */
+	unsigned int predict_interval;	/* in ms, 0 if off */
+	unsigned long target_pending;	/* channels whose target is not reached yet */
+	bool target_stop;		/* set on remove, no more watching */
+	struct delayed_work target_work;
+	struct ccp_fan_curve curve[NUM_FANS];
+	struct ccp_virt temp_virt[NUM_VIRT_CHANNELS];
+	struct ccp_virt fan_virt[NUM_VIRT_CHANNELS];
 	DECLARE_BITMAP(temp_cnct, NUM_TEMP_SENSORS);
 	DECLARE_BITMAP(fan_cnct, NUM_FANS);
 	char fan_label[6][LABEL_LENGTH];
 	u8 firmware_ver[3];
 	u8 bootloader_ver[2];
+	unsigned long caps;
+	/* led uploads, protected by led_mutex */
+	struct mutex led_mutex;
+	struct ccp_led_channel leds[NUM_LED_CHANNELS];
+	struct ccp_cmd led_cmds[LED_MAX_CMDS];
+	u8 led_frame[3 * LED_MAX];	/* colors of a frame being built */
+	struct ccp_led_stats led_stats;
+	struct ccp_led_stream stream;
+	/* protected by stream.mutex */
+	struct ccp_led_indicator indicator[NUM_LED_CHANNELS];
+	struct delayed_work indicator_work;
+#ifdef CONFIG_PERF_EVENTS
+	struct ccp_pmu *pmu;		/* NULL if no pmu is registered */
+	struct delayed_work pmu_work;
+#endif
 };
 
-/* converts response error in buffer to errno */
-static int ccp_get_errno(struct ccp_device *ccp)
-{
-	switch (ccp->buffer[0]) {
-	case 0x00: /* success */
-		return 0;
-	case 0x01: /* called invalid command */
-		return -EOPNOTSUPP;
-	case 0x10: /* called GET_VOLT / GET_TMP with invalid arguments */
-		return -EINVAL;
-	case 0x11: /* requested temps of disconnected sensors */
-	case 0x12: /* requested pwm of not pwm controlled channels */
-		return -ENODATA;
-	default:
-		hid_dbg(ccp->hdev, "unknown device response error: %d", ccp->buffer[0]);
-		return -EIO;
-	}
-}
-
 /* send command, check for error in response, response in ccp->buffer */
 static int send_usb_cmd(struct ccp_device *ccp, u8 command, u8 byte1, u8 byte2, u8 byte3)
 {
-	unsigned long t;
+	struct ccp_cmd cmd;
 	int ret;
 
-	memset(ccp->cmd_buffer, 0x00, OUT_BUFFER_SIZE);
-	ccp->cmd_buffer[0] = command;
-	ccp->cmd_buffer[1] = byte1;
-	ccp->cmd_buffer[2] = byte2;
-	ccp->cmd_buffer[3] = byte3;
-
-	/*
-	 * Disable raw event parsing for a moment to safely reinitialize the
-	 * completion. Reinit is done because hidraw could have triggered
-	 * the raw event parsing and marked the ccp->wait_input_report
-	 * completion as done.
-	 */
-	spin_lock_bh(&ccp->wait_input_report_lock);
-	reinit_completion(&ccp->wait_input_report);
-	spin_unlock_bh(&ccp->wait_input_report_lock);
-
-	ret = hid_hw_output_report(ccp->hdev, ccp->cmd_buffer, OUT_BUFFER_SIZE);
-	if (ret < 0)
+	ccp_cmd_init(&cmd, command, byte1, byte2, byte3);
+
+	ret = ccp_core_xfer(&ccp->core, &cmd);
+	if (ret)
 		return ret;
 
-	t = wait_for_completion_timeout(&ccp->wait_input_report, msecs_to_jiffies(REQ_TIMEOUT));
-	if (!t)
-		return -ETIMEDOUT;
+	memcpy(ccp->buffer, cmd.in, CCP_IN_BUFFER_SIZE);
 
-	return ccp_get_errno(ccp);
+	return ccp_core_errno(&ccp->core, &cmd);
 }
 
 static int ccp_raw_event(struct hid_device *hdev, struct hid_report *report, u8 *data, int size)
 {
 	struct ccp_device *ccp = hid_get_drvdata(hdev);
 
-	/* only copy buffer when requested */
-	spin_lock(&ccp->wait_input_report_lock);
-	if (!completion_done(&ccp->wait_input_report)) {
-		memcpy(ccp->buffer, data, min(IN_BUFFER_SIZE, size));
-		complete_all(&ccp->wait_input_report);
-	}
-	spin_unlock(&ccp->wait_input_report_lock);
+	ccp_core_raw_event(&ccp->core, data, size);
 
 	return 0;
 }
 
-/* requests and returns single data values depending on channel */
-static int get_data(struct ccp_device *ccp, int command, int channel, bool two_byte_data)
+static int set_pwm(struct ccp_device *ccp, int channel, long val)
 {
+	struct ccp_sensor *sensor = &ccp->sensors[CCP_PWM_INPUT][channel];
 	int ret;
 
+	if (val < 0 || val > 255)
+		return -EINVAL;
+
+	/* The Corsair Commander Pro uses values from 0-100 */
+	val = DIV_ROUND_CLOSEST(val * 100, 255);
+
 	mutex_lock(&ccp->mutex);
 
-	ret = send_usb_cmd(ccp, command, channel, 0, 0);
-	if (ret)
-		goto out_unlock;
+	ret = send_usb_cmd(ccp, CTL_SET_FAN_FPWM, channel, val, 0);
+	if (!ret) {
+		ccp->target[channel] = -ENODATA;
+		ccp->pwm_enable[channel] = CCP_PWM_MANUAL;
+		sensor->value = val;
+		sensor->updated = jiffies;
+		sensor->valid = true;
+	}
 
-	ret = ccp->buffer[1];
-	if (two_byte_data)
-		ret = (ret << 8) + ccp->buffer[2];
+	mutex_unlock(&ccp->mutex);
+	return ret;
+}
+
+/*
+ * After fan_target is written, the fan speed is checked once per second. The target is
+ * reached after CCP_TARGET_SETTLE readings within the tolerance. Reaching it, giving up
+ * after CCP_TARGET_TIMEOUT and pwm or the fan curve taking over notify pollers of
+ * fan_target_reached, so tools sleep in poll() instead of reading fan_input in a loop.
+ */
+static void ccp_target_notify(struct ccp_device *ccp, int channel)
+{
+	char name[32];
+
+	scnprintf(name, sizeof(name), "fan%d_target_reached", channel + 1);
+	sysfs_notify(&ccp->hwmon_dev->kobj, NULL, name);
+}
+
+/* must be called with ccp->mutex held */
+static void ccp_target_watch(struct ccp_device *ccp, int channel)
+{
+	struct ccp_target_watch *watch = &ccp->watch[channel];
+	bool reached = watch->reached;
+
+	if (ccp->target_stop)
+		return;
+
+	watch->reached = false;
+	watch->hits = 0;
+	watch->since = jiffies;
+	set_bit(channel, &ccp->target_pending);
+	mod_delayed_work(system_wq, &ccp->target_work, SENSOR_CACHE_TIME);
+
+	if (reached)
+		ccp_target_notify(ccp, channel);
+}
+
+static int set_target(struct ccp_device *ccp, int channel, long val)
+{
+	struct ccp_sensor *sensor = &ccp->sensors[CCP_PWM_INPUT][channel];
+	int ret;
+
+	val = clamp_val(val, 0, 0xFFFF);
+	ccp->target[channel] = val;
+
+	mutex_lock(&ccp->mutex);
+	ret = send_usb_cmd(ccp, CTL_SET_FAN_TARGET, channel, val >> 8, val);
+	if (!ret) {
+		ccp_target_watch(ccp, channel);
+		ccp->pwm_enable[channel] = CCP_PWM_MANUAL;
+		/* the device no longer reports a pwm value for this channel */
+		sensor->value = -ENODATA;
+		sensor->updated = jiffies;
+		sensor->valid = true;
+	}
 
-out_unlock:
 	mutex_unlock(&ccp->mutex);
 	return ret;
 }
 
-static int set_pwm(struct ccp_device *ccp, int channel, long val)
+static int get_target(struct ccp_device *ccp, int channel, long *val)
+{
+	/* how to read target values from the device is unknown */
+	/* driver returns last set value or 0			*/
+	if (ccp->target[channel] < 0)
+		return -ENODATA;
+	*val = ccp->target[channel];
+	return 0;
+}
+
+/* builds the CTL_SET_FAN_CURVE frame, the temperatures have to rise from point to point */
+static int fan_curve_cmd(const struct ccp_fan_curve *curve, int channel, struct ccp_cmd *cmd)
+{
+	int i;
+
+	for (i = 1; i < NUM_CURVE_POINTS; i++)
+		if (curve->temp[i] < curve->temp[i - 1])
+			return -EINVAL;
+
+	ccp_cmd_init(cmd, CTL_SET_FAN_CURVE, channel, curve->sensor, 0);
+	for (i = 0; i < NUM_CURVE_POINTS; i++) {
+		put_unaligned_be16(curve->temp[i] / 10, &cmd->out[3 + 2 * i]);
+		put_unaligned_be16(curve->rpm[i], &cmd->out[15 + 2 * i]);
+	}
+
+	return 0;
+}
+
+/* must be called with ccp->mutex held */
+static int send_fan_curve(struct ccp_device *ccp, int channel)
 {
+	struct ccp_cmd cmd;
 	int ret;
 
-	if (val < 0 || val > 255)
-		return -EINVAL;
+	if (!(ccp->caps & CCP_CAP_FAN_CURVE))
+		return -EOPNOTSUPP;
 
-	/* The Corsair Commander Pro uses values from 0-100 */
-	val = DIV_ROUND_CLOSEST(val * 100, 255);
+	ret = fan_curve_cmd(&ccp->curve[channel], channel, &cmd);
+	if (ret)
+		return ret;
+
+	ret = ccp_core_xfer(&ccp->core, &cmd);
+	if (ret)
+		return ret;
+
+	ret = ccp_core_errno(&ccp->core, &cmd);
+	/* the firmware has no fan curves, later requests are not sent */
+	if (ret == -EOPNOTSUPP)
+		ccp->caps &= ~CCP_CAP_FAN_CURVE;
+
+	return ret;
+}
+
+/*
+ * 0: full speed, 1: manual, keeps the current speed as fan_target until pwm or fan_target
+ * is written, 2: the device follows the fan curve set in pwm[1-6]_auto_point*
+ */
+static int set_pwm_enable(struct ccp_device *ccp, int channel, long val)
+{
+	struct ccp_sensor *sensor = &ccp->sensors[CCP_PWM_INPUT][channel];
+	int ret;
 
 	mutex_lock(&ccp->mutex);
 
-	ret = send_usb_cmd(ccp, CTL_SET_FAN_FPWM, channel, val, 0);
-	if (!ret)
-		ccp->target[channel] = -ENODATA;
+	switch (val) {
+	case CCP_PWM_FULL:
+		ret = send_usb_cmd(ccp, CTL_SET_FAN_FPWM, channel, 100, 0);
+		if (!ret) {
+			ccp->target[channel] = -ENODATA;
+			sensor->value = 100;
+		}
+		break;
+	case CCP_PWM_MANUAL:
+		ret = send_usb_cmd(ccp, CTL_GET_FAN_RPM, channel, 0, 0);
+		if (ret)
+			break;
+		ccp->target[channel] = get_unaligned_be16(&ccp->buffer[1]);
+		ret = send_usb_cmd(ccp, CTL_SET_FAN_TARGET, channel,
+				   ccp->target[channel] >> 8, ccp->target[channel]);
+		if (!ret)
+			sensor->value = -ENODATA;
+		break;
+	case CCP_PWM_CURVE:
+		ret = send_fan_curve(ccp, channel);
+		if (!ret) {
+			ccp->target[channel] = -ENODATA;
+			sensor->value = -ENODATA;
+		}
+		break;
+	default:
+		ret = -EINVAL;
+		break;
+	}
+
+	if (!ret) {
+		ccp->pwm_enable[channel] = val;
+		sensor->updated = jiffies;
+		sensor->valid = true;
+	}
 
 	mutex_unlock(&ccp->mutex);
 	return ret;
 }
 
-static int set_target(struct ccp_device *ccp, int channel, long val)
+static int get_pwm_enable(struct ccp_device *ccp, int channel, long *val)
+{
+	/* the device has no command to read the mode */
+	if (ccp->pwm_enable[channel] < 0)
+		return -ENODATA;
+	*val = ccp->pwm_enable[channel];
+	return 0;
+}
+
+/*
+ * Disabled channels are left out of sensor sweeps and their input reads fail with
+ * -ENODATA, which frees command slots for the channels in use.
+ */
+static int get_enable(struct ccp_device *ccp, int id, int channel, long *val)
+{
+	*val = !test_bit(channel, &ccp->disabled[id]);
+	return 0;
+}
+
+static int set_enable(struct ccp_device *ccp, int id, int channel, long val)
+{
+	if (val != 0 && val != 1)
+		return -EINVAL;
+
+	mutex_lock(&ccp->mutex);
+	if (val) {
+		clear_bit(channel, &ccp->disabled[id]);
+		/* the cached value is from before disabling */
+		ccp->sensors[id][channel].valid = false;
+	} else {
+		set_bit(channel, &ccp->disabled[id]);
+	}
+	mutex_unlock(&ccp->mutex);
+
+	return 0;
+}
+
+static int get_temp_enable(struct ccp_device *ccp, int channel, long *val)
+{
+	return get_enable(ccp, CCP_TEMP_INPUT, channel, val);
+}
+
+static int set_temp_enable(struct ccp_device *ccp, int channel, long val)
+{
+	return set_enable(ccp, CCP_TEMP_INPUT, channel, val);
+}
+
+static int get_fan_enable(struct ccp_device *ccp, int channel, long *val)
+{
+	return get_enable(ccp, CCP_FAN_INPUT, channel, val);
+}
+
+static int set_fan_enable(struct ccp_device *ccp, int channel, long val)
+{
+	return set_enable(ccp, CCP_FAN_INPUT, channel, val);
+}
+
+static int get_in_enable(struct ccp_device *ccp, int channel, long *val)
+{
+	return get_enable(ccp, CCP_IN_INPUT, channel, val);
+}
+
+static int set_in_enable(struct ccp_device *ccp, int channel, long val)
+{
+	return set_enable(ccp, CCP_IN_INPUT, channel, val);
+}
+
+static int get_fan_label(struct ccp_device *ccp, int channel, const char **str)
+{
+	*str = ccp->fan_label[channel];
+	return 0;
+}
+
+static const struct ccp_sensor_desc ccp_sensors[CCP_NUM_SENSOR_IDS] = {
+	[CCP_TEMP_INPUT] = {
+		.type = hwmon_temp,
+		.attr = hwmon_temp_input,
+		.command = CTL_GET_TMP,
+		.width = 2,
+		.mul = 10,
+		.div = 1,
+		.channels = NUM_TEMP_SENSORS,
+		.cnct = CCP_CNCT_TEMP,
+		.mode = 0444,
+		.flags = CCP_SENSOR_SWEEP | CCP_SENSOR_VIRT,
+	},
+	[CCP_TEMP_LABEL] = {
+		/* only the virtual channels have labels */
+		.type = hwmon_temp,
+		.attr = hwmon_temp_label,
+		.channels = 0,
+		.mode = 0444,
+		.flags = CCP_SENSOR_VIRT,
+	},
+	[CCP_TEMP_ENABLE] = {
+		.type = hwmon_temp,
+		.attr = hwmon_temp_enable,
+		.channels = NUM_TEMP_SENSORS,
+		.cnct = CCP_CNCT_TEMP,
+		.mode = 0644,
+		.read = get_temp_enable,
+		.write = set_temp_enable,
+	},
+	[CCP_FAN_INPUT] = {
+		.type = hwmon_fan,
+		.attr = hwmon_fan_input,
+		.command = CTL_GET_FAN_RPM,
+		.width = 2,
+		.mul = 1,
+		.div = 1,
+		.channels = NUM_FANS,
+		.cnct = CCP_CNCT_FAN,
+		.mode = 0444,
+		.flags = CCP_SENSOR_SWEEP | CCP_SENSOR_VIRT,
+	},
+	[CCP_FAN_ENABLE] = {
+		.type = hwmon_fan,
+		.attr = hwmon_fan_enable,
+		.channels = NUM_FANS,
+		.cnct = CCP_CNCT_FAN,
+		.mode = 0644,
+		.read = get_fan_enable,
+		.write = set_fan_enable,
+	},
+	[CCP_FAN_LABEL] = {
+		.type = hwmon_fan,
+		.attr = hwmon_fan_label,
+		.channels = NUM_FANS,
+		.cnct = CCP_CNCT_FAN,
+		.mode = 0444,
+		.flags = CCP_SENSOR_VIRT,
+		.read_string = get_fan_label,
+	},
+	[CCP_FAN_TARGET] = {
+		.type = hwmon_fan,
+		.attr = hwmon_fan_target,
+		.channels = NUM_FANS,
+		.cnct = CCP_CNCT_FAN,
+		.mode = 0644,
+		.read = get_target,
+		.write = set_target,
+	},
+	[CCP_PWM_INPUT] = {
+		/* not swept, fans controlled by fan_target answer with an error */
+		.type = hwmon_pwm,
+		.attr = hwmon_pwm_input,
+		.command = CTL_GET_FAN_PWM,
+		.width = 1,
+		.mul = 255,
+		.div = 100,
+		.channels = NUM_FANS,
+		.cnct = CCP_CNCT_FAN,
+		.mode = 0644,
+		.write = set_pwm,
+	},
+	[CCP_PWM_ENABLE] = {
+		.type = hwmon_pwm,
+		.attr = hwmon_pwm_enable,
+		.channels = NUM_FANS,
+		.cnct = CCP_CNCT_FAN,
+		.mode = 0644,
+		.caps = CCP_CAP_FAN_CURVE,
+		.read = get_pwm_enable,
+		.write = set_pwm_enable,
+	},
+	[CCP_IN_INPUT] = {
+		.type = hwmon_in,
+		.attr = hwmon_in_input,
+		.command = CTL_GET_VOLT,
+		.width = 2,
+		.mul = 1,
+		.div = 1,
+		.channels = NUM_VOLTS,
+		.cnct = CCP_CNCT_NONE,
+		.mode = 0444,
+		.flags = CCP_SENSOR_SWEEP,
+	},
+	[CCP_IN_ENABLE] = {
+		.type = hwmon_in,
+		.attr = hwmon_in_enable,
+		.channels = NUM_VOLTS,
+		.cnct = CCP_CNCT_NONE,
+		.mode = 0644,
+		.read = get_in_enable,
+		.write = set_in_enable,
+	},
+};
+
+/* returns the index into ccp_sensors[] or -EOPNOTSUPP */
+static int ccp_sensor_id(enum hwmon_sensor_types type, u32 attr)
+{
+	int id;
+
+	for (id = 0; id < CCP_NUM_SENSOR_IDS; id++)
+		if (ccp_sensors[id].type == type && ccp_sensors[id].attr == attr)
+			return id;
+
+	return -EOPNOTSUPP;
+}
+
+static bool ccp_connected(const struct ccp_device *ccp, const struct ccp_sensor_desc *desc,
+			  int channel)
+{
+	switch (desc->cnct) {
+	case CCP_CNCT_TEMP:
+		return test_bit(channel, ccp->temp_cnct);
+	case CCP_CNCT_FAN:
+		return test_bit(channel, ccp->fan_cnct);
+	default:
+		return true;
+	}
+}
+
+/*
+ * Every temperature sample updates an alpha-beta filter, the steady state Kalman filter
+ * of a temperature changing at a constant rate. Between samples temp[1-4]_predicted
+ * extrapolates along the slope, so control loops can run faster than the device is
+ * asked, or the device can be asked less often. The uncertainty is the RMS error of
+ * predicting the samples, growing with the time since the last one.
+ */
+static void ccp_estimate_update(struct ccp_estimate *est, int temp)
+{
+	unsigned long now = jiffies;
+	s64 pred;
+	int err;
+	int dt;
+
+	dt = jiffies_to_msecs(now - est->time);
+	if (est->valid && !dt)
+		return;
+
+	if (!est->valid || dt > PREDICT_INTERVAL_MAX) {
+		*est = (struct ccp_estimate){ .valid = true, .temp = temp, .time = now };
+		return;
+	}
+
+	pred = est->temp + div_s64(est->slope * dt, 1000 * 256);
+	err = temp - pred;
+
+	/* alpha 1/2, beta 1/16 */
+	est->temp = pred + err / 2;
+	est->slope += div_s64((s64)err * 1000 * 256, dt * 16);
+	est->err2 += div_s64((s64)err * err - est->err2, 8);
+	est->time = now;
+	est->interval = dt;
+}
+
+/* must be called with ccp->mutex held */
+static void ccp_estimate(const struct ccp_estimate *est, int *temp, int *uncertainty)
+{
+	int dt = jiffies_to_msecs(jiffies - est->time);
+
+	*temp = est->temp + div_s64(est->slope * dt, 1000 * 256);
+	*uncertainty = PREDICT_RESOLUTION;
+	if (est->interval)
+		*uncertainty += div_s64((s64)int_sqrt64(est->err2) * dt, est->interval);
+}
+
+static void ccp_store_sensor(struct ccp_device *ccp, const struct ccp_sensor_desc *desc,
+			     struct ccp_sensor *sensor, const struct ccp_cmd *cmd)
+{
+	int ret;
+	int i;
+
+	ret = ccp_core_errno(&ccp->core, cmd);
+	if (!ret)
+		for (i = 1; i <= desc->width; i++)
+			ret = (ret << 8) + cmd->in[i];
+
+	sensor->value = ret;
+	sensor->updated = jiffies;
+	sensor->valid = true;
+
+	if (desc == &ccp_sensors[CCP_TEMP_INPUT] && ret >= 0)
+		ccp_estimate_update(&ccp->estimate[sensor - ccp->sensors[CCP_TEMP_INPUT]],
+				    DIV_ROUND_CLOSEST(ret * desc->mul, desc->div));
+}
+
+/* a reading arriving later would already be out of the cache */
+static ktime_t ccp_sensor_deadline(void)
+{
+	return ktime_add_ms(ktime_get(), jiffies_to_msecs(SENSOR_CACHE_TIME));
+}
+
+/*
+ * The device has no command returning several channels at once, so a sweep needs one
+ * request per connected channel. Channels still in the cache are left out. With
+ * CCP_CAP_BATCH the others are all sent as one batch.
+ */
+static int ccp_update_sensors(struct ccp_device *ccp)
+{
+	struct ccp_req *reqs = ccp->sweep_reqs;
+	struct ccp_cmd *cmds = ccp->sweep_cmds;
+	const struct ccp_sensor_desc *desc;
+	ktime_t deadline = ccp_sensor_deadline();
+	struct ccp_sensor *sensor;
+	int count = 0;
+	int channel;
+	int ret = 0;
+	int id;
+	int i;
+
+	for (id = 0; id < CCP_NUM_SENSOR_IDS; id++) {
+		desc = &ccp_sensors[id];
+		if (!(desc->flags & CCP_SENSOR_SWEEP))
+			continue;
+
+		for (channel = 0; channel < desc->channels; channel++) {
+			sensor = &ccp->sensors[id][channel];
+			if (!ccp_connected(ccp, desc, channel) ||
+			    test_bit(channel, &ccp->disabled[id]))
+				continue;
+			/* another user of the cache may have swept it already */
+			if (sensor->valid && time_before(jiffies, sensor->updated + SENSOR_CACHE_TIME))
+				continue;
+			reqs[count] = (struct ccp_req){ desc, channel, sensor };
+			ccp_cmd_init(&cmds[count], desc->command, channel, 0, 0);
+			cmds[count].deadline = deadline;
+			count++;
+		}
+	}
+
+	ccp_core_submit(&ccp->core, cmds, count);
+
+	/* a failed transfer fails the read, the others are still worth caching */
+	for (i = 0; i < count; i++) {
+		if (cmds[i].status)
+			ret = cmds[i].status;
+		else
+			ccp_store_sensor(ccp, reqs[i].desc, reqs[i].sensor, &cmds[i]);
+	}
+
+	return ret;
+}
+
+/* fills the cache after probe, so the first reads do not wait for the device */
+static void ccp_warm_work(struct work_struct *work)
+{
+	struct ccp_device *ccp = container_of(work, struct ccp_device, warm_work);
+
+	mutex_lock(&ccp->mutex);
+	/* failed channels are requested again on their first read */
+	ccp_update_sensors(ccp);
+	mutex_unlock(&ccp->mutex);
+}
+
+/*
+ * Without CCP_CAP_BATCH every cache miss costs a round trip of its own. Tools like sensors
+ * read the channels in order, so after two misses in ascending order the other stale
+ * channels are fetched in the background, one at a time and with low priority, starting
+ * behind the last miss. The following reads are then served from the cache.
+ */
+#define CCP_RA_POS(id, channel)	((id) << 8 | (channel))
+
+/* fetches the stale channels with a position from first to last */
+static void ccp_readahead_range(struct ccp_device *ccp, unsigned int first, unsigned int last)
+{
+	const struct ccp_sensor_desc *desc;
+	struct ccp_sensor *sensor;
+	unsigned long start;
+	struct ccp_cmd cmd;
+	unsigned int pos;
+	bool stale;
+	int channel;
+	int id;
+
+	for (id = 0; id < CCP_NUM_SENSOR_IDS; id++) {
+		desc = &ccp_sensors[id];
+		if (!(desc->flags & CCP_SENSOR_SWEEP))
+			continue;
+
+		for (channel = 0; channel < desc->channels; channel++) {
+			pos = CCP_RA_POS(id, channel);
+			if (pos < first || pos > last)
+				continue;
+
+			sensor = &ccp->sensors[id][channel];
+			mutex_lock(&ccp->mutex);
+			stale = ccp_connected(ccp, desc, channel) &&
+				!test_bit(channel, &ccp->disabled[id]) &&
+				!(sensor->valid &&
+				  time_before(jiffies, sensor->updated + SENSOR_CACHE_TIME));
+			mutex_unlock(&ccp->mutex);
+			if (!stale)
+				continue;
+
+			/* readers must not wait behind a low priority transfer */
+			start = jiffies;
+			ccp_cmd_init(&cmd, desc->command, channel, 0, 0);
+			cmd.deadline = ccp_sensor_deadline();
+			ccp_core_submit_prio(&ccp->core, &cmd, 1, CCP_PRIO_LOW);
+			if (cmd.status)
+				continue;
+
+			mutex_lock(&ccp->mutex);
+			/* a reader may have stored a newer reading meanwhile */
+			if (!(sensor->valid && time_after(sensor->updated, start)))
+				ccp_store_sensor(ccp, desc, sensor, &cmd);
+			mutex_unlock(&ccp->mutex);
+		}
+	}
+}
+
+static void ccp_readahead_work(struct work_struct *work)
+{
+	struct ccp_device *ccp = container_of(work, struct ccp_device, readahead_work);
+	unsigned int start;
+
+	mutex_lock(&ccp->mutex);
+	start = ccp->ra_pos;
+	mutex_unlock(&ccp->mutex);
+
+	ccp_readahead_range(ccp, start + 1, UINT_MAX);
+	if (start)
+		ccp_readahead_range(ccp, 0, start - 1);
+}
+
+/* called with mutex held on a cache miss of a sweep channel */
+static void ccp_readahead_miss(struct ccp_device *ccp, int id, int channel)
+{
+	unsigned int pos = CCP_RA_POS(id, channel);
+
+	if (pos > ccp->ra_pos && time_before(jiffies, ccp->ra_time + SENSOR_CACHE_TIME))
+		schedule_work(&ccp->readahead_work);
+	ccp->ra_pos = pos;
+	ccp->ra_time = jiffies;
+}
+
+/* returns the cached raw value of a sensor, requesting it again when it is too old */
+static int get_sensor(struct ccp_device *ccp, int id, int channel)
+{
+	const struct ccp_sensor_desc *desc = &ccp_sensors[id];
+	struct ccp_sensor *sensor = &ccp->sensors[id][channel];
+	struct ccp_cmd cmd;
+	int ret = 0;
+
+	mutex_lock(&ccp->mutex);
+
+	/* a reading cached before disabling is not served either */
+	if (test_bit(channel, &ccp->disabled[id])) {
+		ret = -ENODATA;
+		goto out_unlock;
+	}
+
+	if (sensor->valid && time_before(jiffies, sensor->updated + SENSOR_CACHE_TIME))
+		goto out_value;
+
+	if ((desc->flags & CCP_SENSOR_SWEEP) && (ccp->caps & CCP_CAP_BATCH)) {
+		ret = ccp_update_sensors(ccp);
+		/* the other channels of the sweep may have failed */
+		if (ret && sensor->valid &&
+		    time_before(jiffies, sensor->updated + SENSOR_CACHE_TIME))
+			ret = 0;
+	} else {
+		if (desc->flags & CCP_SENSOR_SWEEP)
+			ccp_readahead_miss(ccp, id, channel);
+		ccp_cmd_init(&cmd, desc->command, channel, 0, 0);
+		cmd.deadline = ccp_sensor_deadline();
+		ret = ccp_core_xfer(&ccp->core, &cmd);
+		if (!ret)
+			ccp_store_sensor(ccp, desc, sensor, &cmd);
+	}
+	/* the sweep leaves out unconnected and disabled channels */
+	if (!ret && !sensor->valid)
+		ret = -ENODATA;
+	if (ret)
+		goto out_unlock;
+
+out_value:
+	ret = sensor->value;
+out_unlock:
+	mutex_unlock(&ccp->mutex);
+	return ret;
+}
+
+/* must be called with ccp->mutex held */
+static void ccp_target_check(struct ccp_device *ccp, int channel, int rpm)
+{
+	struct ccp_target_watch *watch = &ccp->watch[channel];
+
+	if (ccp->target[channel] >= 0) {
+		if (rpm >= 0 && abs(rpm - ccp->target[channel]) <= watch->tolerance) {
+			if (++watch->hits < CCP_TARGET_SETTLE)
+				return;
+			watch->reached = true;
+		} else {
+			watch->hits = 0;
+			if (time_before(jiffies, watch->since + CCP_TARGET_TIMEOUT))
+				return;
+		}
+	}
+
+	clear_bit(channel, &ccp->target_pending);
+	ccp_target_notify(ccp, channel);
+}
+
+static void ccp_target_work(struct work_struct *work)
+{
+	struct ccp_device *ccp = container_of(to_delayed_work(work), struct ccp_device,
+					      target_work);
+	unsigned long pending;
+	int channel;
+	int rpm;
+
+	mutex_lock(&ccp->mutex);
+	pending = ccp->target_pending;
+	mutex_unlock(&ccp->mutex);
+
+	for_each_set_bit(channel, &pending, NUM_FANS) {
+		/* from the cache, at most one sweep for all channels */
+		rpm = get_sensor(ccp, CCP_FAN_INPUT, channel);
+
+		mutex_lock(&ccp->mutex);
+		if (ccp->target_stop || !test_bit(channel, &ccp->target_pending)) {
+			mutex_unlock(&ccp->mutex);
+			continue;
+		}
+		/* a disabled fan is not read, its watch ends unreached */
+		if (test_bit(channel, &ccp->disabled[CCP_FAN_INPUT])) {
+			clear_bit(channel, &ccp->target_pending);
+			ccp_target_notify(ccp, channel);
+		} else {
+			ccp_target_check(ccp, channel, rpm);
+		}
+		mutex_unlock(&ccp->mutex);
+	}
+
+	mutex_lock(&ccp->mutex);
+	if (ccp->target_pending && !ccp->target_stop)
+		schedule_delayed_work(&ccp->target_work, SENSOR_CACHE_TIME);
+	mutex_unlock(&ccp->mutex);
+}
+
+static void ccp_target_init(struct ccp_device *ccp)
+{
+	int channel;
+
+	INIT_DELAYED_WORK(&ccp->target_work, ccp_target_work);
+	for (channel = 0; channel < NUM_FANS; channel++)
+		ccp->watch[channel].tolerance = CCP_TARGET_TOLERANCE;
+}
+
+/* no notifications after it, the hwmon device may go away */
+static void ccp_target_stop(struct ccp_device *ccp)
+{
+	mutex_lock(&ccp->mutex);
+	ccp->target_stop = true;
+	mutex_unlock(&ccp->mutex);
+	cancel_delayed_work_sync(&ccp->target_work);
+}
+
+static struct ccp_virt *ccp_virt_get(struct ccp_device *ccp, int id, int n)
+{
+	return id == CCP_TEMP_INPUT ? &ccp->temp_virt[n] : &ccp->fan_virt[n];
+}
+
+/* computes a virtual channel from the cache, a sweep refreshes all sources at once */
+static int ccp_read_virt(struct ccp_device *ccp, int id, int n, long *val)
+{
+	const struct ccp_sensor_desc *desc = &ccp_sensors[id];
+	struct ccp_virt virt;
+	s64 sum = 0;
+	long v[NUM_VIRT_SOURCES];
+	int ret;
+	int i;
+
+	mutex_lock(&ccp->mutex);
+	virt = *ccp_virt_get(ccp, id, n);
+	mutex_unlock(&ccp->mutex);
+
+	if (virt.op == CCP_VIRT_NONE)
+		return -ENODATA;
+
+	for (i = 0; i < virt.count; i++) {
+		if (!ccp_connected(ccp, desc, virt.src[i]) ||
+		    test_bit(virt.src[i], &ccp->disabled[id]))
+			return -ENODATA;
+		ret = get_sensor(ccp, id, virt.src[i]);
+		if (ret < 0)
+			return ret;
+		v[i] = DIV_ROUND_CLOSEST(ret * desc->mul, desc->div);
+	}
+
+	*val = v[0];
+	for (i = 0; i < virt.count; i++) {
+		switch (virt.op) {
+		case CCP_VIRT_MAX:
+			*val = max(*val, v[i]);
+			break;
+		case CCP_VIRT_MIN:
+			*val = min(*val, v[i]);
+			break;
+		default:
+			sum += (s64)v[i] * virt.weight[i];
+			break;
+		}
+	}
+
+	/* diff is a sum with the weights set by the parser */
+	if (virt.op == CCP_VIRT_AVG)
+		*val = div_s64(sum, 1000 * virt.count);
+	else if (virt.op != CCP_VIRT_MAX && virt.op != CCP_VIRT_MIN)
+		*val = div_s64(sum, 1000);
+
+	return 0;
+}
+
+/* a temp channel with readings, virtual ones need all their sources */
+static bool ccp_temp_usable(struct ccp_device *ccp, int channel)
+{
+	const struct ccp_sensor_desc *desc = &ccp_sensors[CCP_TEMP_INPUT];
+	const struct ccp_virt *virt;
+	bool usable;
+	int i;
+
+	mutex_lock(&ccp->mutex);
+	if (channel < desc->channels) {
+		usable = ccp_connected(ccp, desc, channel) &&
+			 !test_bit(channel, &ccp->disabled[CCP_TEMP_INPUT]);
+	} else {
+		virt = &ccp->temp_virt[channel - desc->channels];
+		usable = virt->op != CCP_VIRT_NONE;
+		for (i = 0; i < virt->count; i++)
+			if (!ccp_connected(ccp, desc, virt->src[i]) ||
+			    test_bit(virt->src[i], &ccp->disabled[CCP_TEMP_INPUT]))
+				usable = false;
+	}
+	mutex_unlock(&ccp->mutex);
+
+	return usable;
+}
+
+static int ccp_read_string(struct device *dev, enum hwmon_sensor_types type,
+			   u32 attr, int channel, const char **str)
+{
+	static const char * const virt_labels[NUM_VIRT_CHANNELS] = {
+		"virtual1", "virtual2",
+	};
+	struct ccp_device *ccp = dev_get_drvdata(dev);
+	int id = ccp_sensor_id(type, attr);
+	int virt;
+
+	if (id < 0)
+		return -EOPNOTSUPP;
+	if (channel >= ccp_sensors[id].channels) {
+		/* the virtual channels follow the physical ones, not the labels */
+		virt = channel - (type == hwmon_temp ? NUM_TEMP_SENSORS : NUM_FANS);
+		if (virt < 0 || virt >= NUM_VIRT_CHANNELS)
+			return -EOPNOTSUPP;
+		*str = virt_labels[virt];
+		return 0;
+	}
+	if (!ccp_sensors[id].read_string)
+		return -EOPNOTSUPP;
+
+	return ccp_sensors[id].read_string(ccp, channel, str);
+}
+
+static int ccp_read(struct device *dev, enum hwmon_sensor_types type,
+		    u32 attr, int channel, long *val)
+{
+	struct ccp_device *ccp = dev_get_drvdata(dev);
+	const struct ccp_sensor_desc *desc;
+	int id = ccp_sensor_id(type, attr);
+	int ret;
+
+	if (id < 0)
+		return id;
+
+	desc = &ccp_sensors[id];
+	if (channel >= desc->channels)
+		return ccp_read_virt(ccp, id, channel - desc->channels, val);
+	if (desc->read)
+		return desc->read(ccp, channel, val);
+	if (!desc->command)
+		return -EOPNOTSUPP;
+
+	ret = get_sensor(ccp, id, channel);
+	if (ret < 0)
+		return ret;
+
+	*val = DIV_ROUND_CLOSEST(ret * desc->mul, desc->div);
+	return 0;
+};
+
+static int ccp_write(struct device *dev, enum hwmon_sensor_types type,
+		     u32 attr, int channel, long val)
+{
+	struct ccp_device *ccp = dev_get_drvdata(dev);
+	int id = ccp_sensor_id(type, attr);
+
+	if (id < 0 || !ccp_sensors[id].write)
+		return -EOPNOTSUPP;
+
+	return ccp_sensors[id].write(ccp, channel, val);
+};
+
+static umode_t ccp_is_visible(const void *data, enum hwmon_sensor_types type,
+			      u32 attr, int channel)
+{
+	const struct ccp_device *ccp = data;
+	int id = ccp_sensor_id(type, attr);
+
+	if (id < 0)
+		return 0;
+	if (channel >= ccp_sensors[id].channels)
+		return ccp_sensors[id].flags & CCP_SENSOR_VIRT ? 0444 : 0;
+	if (!ccp_connected(ccp, &ccp_sensors[id], channel))
+		return 0;
+	if ((ccp->caps & ccp_sensors[id].caps) != ccp_sensors[id].caps)
+		return 0;
+
+	return ccp_sensors[id].mode;
+};
+
+static const struct hwmon_ops ccp_hwmon_ops = {
+	.is_visible = ccp_is_visible,
+	.read = ccp_read,
+	.read_string = ccp_read_string,
+	.write = ccp_write,
+};
+
+static const struct hwmon_channel_info * const ccp_info[] = {
+	HWMON_CHANNEL_INFO(chip,
+			   HWMON_C_REGISTER_TZ),
+	HWMON_CHANNEL_INFO(temp,
+			   HWMON_T_INPUT | HWMON_T_ENABLE,
+			   HWMON_T_INPUT | HWMON_T_ENABLE,
+			   HWMON_T_INPUT | HWMON_T_ENABLE,
+			   HWMON_T_INPUT | HWMON_T_ENABLE,
+			   HWMON_T_INPUT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_LABEL
+			   ),
+	HWMON_CHANNEL_INFO(fan,
+			   HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_TARGET | HWMON_F_ENABLE,
+			   HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_TARGET | HWMON_F_ENABLE,
+			   HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_TARGET | HWMON_F_ENABLE,
+			   HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_TARGET | HWMON_F_ENABLE,
+			   HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_TARGET | HWMON_F_ENABLE,
+			   HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_TARGET | HWMON_F_ENABLE,
+			   HWMON_F_INPUT | HWMON_F_LABEL,
+			   HWMON_F_INPUT | HWMON_F_LABEL
+			   ),
+	HWMON_CHANNEL_INFO(pwm,
+			   HWMON_PWM_INPUT | HWMON_PWM_ENABLE,
+			   HWMON_PWM_INPUT | HWMON_PWM_ENABLE,
+			   HWMON_PWM_INPUT | HWMON_PWM_ENABLE,
+			   HWMON_PWM_INPUT | HWMON_PWM_ENABLE,
+			   HWMON_PWM_INPUT | HWMON_PWM_ENABLE,
+			   HWMON_PWM_INPUT | HWMON_PWM_ENABLE
+			   ),
+	HWMON_CHANNEL_INFO(in,
+			   HWMON_I_INPUT | HWMON_I_ENABLE,
+			   HWMON_I_INPUT | HWMON_I_ENABLE,
+			   HWMON_I_INPUT | HWMON_I_ENABLE
+			   ),
+	NULL
+};
+
+static const struct hwmon_chip_info ccp_chip_info = {
+	.ops = &ccp_hwmon_ops,
+	.info = ccp_info,
+};
+
+enum ccp_curve_field {
+	CCP_CURVE_TEMP,
+	CCP_CURVE_RPM,
+	CCP_CURVE_SENSOR,
+};
+
+/*
+ * Fan curve points: pwmX_auto_pointY_temp in millidegree celsius and pwmX_auto_pointY_rpm,
+ * pwmX_auto_channels_temp selects the temperature sensor. Temperatures have to rise
+ * from point to point, which is checked when the curve is sent. Changes are sent right
+ * away if the curve is active. Only the written field is changed, under the mutex, so
+ * concurrent writers of other points are not undone.
+ */
+static int curve_update(struct ccp_device *ccp, int channel, enum ccp_curve_field field,
+			int point, int val)
+{
+	struct ccp_fan_curve *curve = &ccp->curve[channel];
+	struct ccp_fan_curve old;
+	int ret = 0;
+
+	mutex_lock(&ccp->mutex);
+	old = *curve;
+	switch (field) {
+	case CCP_CURVE_TEMP:
+		curve->temp[point] = val;
+		break;
+	case CCP_CURVE_RPM:
+		curve->rpm[point] = val;
+		break;
+	case CCP_CURVE_SENSOR:
+		curve->sensor = val;
+		break;
+	}
+	if (ccp->pwm_enable[channel] == CCP_PWM_CURVE) {
+		ret = send_fan_curve(ccp, channel);
+		if (ret)
+			*curve = old;
+	}
+	mutex_unlock(&ccp->mutex);
+
+	return ret;
+}
+
+static ssize_t curve_temp_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct sensor_device_attribute_2 *sattr = to_sensor_dev_attr_2(attr);
+	struct ccp_device *ccp = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%d\n", ccp->curve[sattr->index].temp[sattr->nr]);
+}
+
+static ssize_t curve_temp_store(struct device *dev, struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	struct sensor_device_attribute_2 *sattr = to_sensor_dev_attr_2(attr);
+	struct ccp_device *ccp = dev_get_drvdata(dev);
+	long val;
+	int ret;
+
+	ret = kstrtol(buf, 10, &val);
+	if (ret)
+		return ret;
+	if (val < 0 || val > 655350)
+		return -EINVAL;
+
+	ret = curve_update(ccp, sattr->index, CCP_CURVE_TEMP, sattr->nr, val);
+
+	return ret ? ret : count;
+}
+
+static ssize_t curve_rpm_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct sensor_device_attribute_2 *sattr = to_sensor_dev_attr_2(attr);
+	struct ccp_device *ccp = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%u\n", ccp->curve[sattr->index].rpm[sattr->nr]);
+}
+
+static ssize_t curve_rpm_store(struct device *dev, struct device_attribute *attr,
+			       const char *buf, size_t count)
+{
+	struct sensor_device_attribute_2 *sattr = to_sensor_dev_attr_2(attr);
+	struct ccp_device *ccp = dev_get_drvdata(dev);
+	long val;
+	int ret;
+
+	ret = kstrtol(buf, 10, &val);
+	if (ret)
+		return ret;
+
+	ret = curve_update(ccp, sattr->index, CCP_CURVE_RPM, sattr->nr,
+			   clamp_val(val, 0, 0xFFFF));
+
+	return ret ? ret : count;
+}
+
+/* bit mask like other drivers, but the device uses exactly one sensor */
+static ssize_t curve_sensor_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct sensor_device_attribute_2 *sattr = to_sensor_dev_attr_2(attr);
+	struct ccp_device *ccp = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%lu\n", BIT(ccp->curve[sattr->index].sensor));
+}
+
+static ssize_t curve_sensor_store(struct device *dev, struct device_attribute *attr,
+				  const char *buf, size_t count)
+{
+	struct sensor_device_attribute_2 *sattr = to_sensor_dev_attr_2(attr);
+	struct ccp_device *ccp = dev_get_drvdata(dev);
+	unsigned long val;
+	int ret;
+
+	ret = kstrtoul(buf, 10, &val);
+	if (ret)
+		return ret;
+	if (hweight32(val) != 1 || val >= BIT(NUM_TEMP_SENSORS))
+		return -EINVAL;
+
+	ret = curve_update(ccp, sattr->index, CCP_CURVE_SENSOR, 0, __ffs(val));
+
+	return ret ? ret : count;
+}
+
+#define CCP_CURVE_POINT_ATTRS(ch, pt)							\
+	static SENSOR_DEVICE_ATTR_2_RW(pwm##ch##_auto_point##pt##_temp, curve_temp,	\
+				       pt - 1, ch - 1);					\
+	static SENSOR_DEVICE_ATTR_2_RW(pwm##ch##_auto_point##pt##_rpm, curve_rpm,	\
+				       pt - 1, ch - 1)
+
+#define CCP_CURVE_ATTRS(ch)								\
+	static SENSOR_DEVICE_ATTR_2_RW(pwm##ch##_auto_channels_temp, curve_sensor,	\
+				       0, ch - 1);					\
+	CCP_CURVE_POINT_ATTRS(ch, 1);							\
+	CCP_CURVE_POINT_ATTRS(ch, 2);							\
+	CCP_CURVE_POINT_ATTRS(ch, 3);							\
+	CCP_CURVE_POINT_ATTRS(ch, 4);							\
+	CCP_CURVE_POINT_ATTRS(ch, 5);							\
+	CCP_CURVE_POINT_ATTRS(ch, 6)
+
+CCP_CURVE_ATTRS(1);
+CCP_CURVE_ATTRS(2);
+CCP_CURVE_ATTRS(3);
+CCP_CURVE_ATTRS(4);
+CCP_CURVE_ATTRS(5);
+CCP_CURVE_ATTRS(6);
+
+#define CCP_CURVE_POINT_ATTR_PTRS(ch, pt)				\
+	&sensor_dev_attr_pwm##ch##_auto_point##pt##_temp.dev_attr.attr,	\
+	&sensor_dev_attr_pwm##ch##_auto_point##pt##_rpm.dev_attr.attr
+
+#define CCP_CURVE_ATTR_PTRS(ch)						\
+	&sensor_dev_attr_pwm##ch##_auto_channels_temp.dev_attr.attr,	\
+	CCP_CURVE_POINT_ATTR_PTRS(ch, 1),				\
+	CCP_CURVE_POINT_ATTR_PTRS(ch, 2),				\
+	CCP_CURVE_POINT_ATTR_PTRS(ch, 3),				\
+	CCP_CURVE_POINT_ATTR_PTRS(ch, 4),				\
+	CCP_CURVE_POINT_ATTR_PTRS(ch, 5),				\
+	CCP_CURVE_POINT_ATTR_PTRS(ch, 6)
+
+static struct attribute *ccp_curve_attrs[] = {
+	CCP_CURVE_ATTR_PTRS(1),
+	CCP_CURVE_ATTR_PTRS(2),
+	CCP_CURVE_ATTR_PTRS(3),
+	CCP_CURVE_ATTR_PTRS(4),
+	CCP_CURVE_ATTR_PTRS(5),
+	CCP_CURVE_ATTR_PTRS(6),
+	NULL
+};
+
+static umode_t ccp_curve_is_visible(struct kobject *kobj, struct attribute *attr, int n)
+{
+	struct device_attribute *dattr = container_of(attr, struct device_attribute, attr);
+	struct ccp_device *ccp = dev_get_drvdata(kobj_to_dev(kobj));
+
+	if (!(ccp->caps & CCP_CAP_FAN_CURVE) ||
+	    !test_bit(to_sensor_dev_attr_2(dattr)->index, ccp->fan_cnct))
+		return 0;
+
+	return attr->mode;
+}
+
+static const struct attribute_group ccp_curve_group = {
+	.attrs = ccp_curve_attrs,
+	.is_visible = ccp_curve_is_visible,
+};
+
+/*
+ * Virtual channels temp5-6 and fan7-8 are configured by tempX_source and fanX_source:
+ * "<op> <channel>[*<weight>] ...", op is one of ccp_virt_ops, channels count from 1 and
+ * weights are in thousandths, only for sum. diff takes exactly two channels.
+ */
+static int ccp_virt_parse(char *buf, int channels, struct ccp_virt *virt)
+{
+	char *tok, *weight;
+	int ret;
+
+	memset(virt, 0, sizeof(*virt));
+
+	tok = strsep(&buf, " ");
+	ret = match_string(ccp_virt_ops, ARRAY_SIZE(ccp_virt_ops), tok);
+	if (ret < 0)
+		return -EINVAL;
+	virt->op = ret;
+
+	while ((tok = strsep(&buf, " "))) {
+		if (!*tok)
+			continue;
+		if (virt->count == NUM_VIRT_SOURCES)
+			return -EINVAL;
+
+		virt->weight[virt->count] = 1000;
+		weight = strchr(tok, '*');
+		if (weight) {
+			*weight++ = '\0';
+			if (virt->op != CCP_VIRT_SUM)
+				return -EINVAL;
+			ret = kstrtoint(weight, 10, &virt->weight[virt->count]);
+			if (ret)
+				return ret;
+		}
+
+		ret = kstrtou8(tok, 10, &virt->src[virt->count]);
+		if (ret)
+			return ret;
+		if (virt->src[virt->count] < 1 || virt->src[virt->count] > channels)
+			return -EINVAL;
+		virt->src[virt->count++]--;
+	}
+
+	if (virt->op == CCP_VIRT_NONE ? virt->count : !virt->count)
+		return -EINVAL;
+	if (virt->op == CCP_VIRT_DIFF && virt->count != 2)
+		return -EINVAL;
+
+	if (virt->op == CCP_VIRT_DIFF)
+		virt->weight[1] = -1000;
+
+	return 0;
+}
+
+static ssize_t virt_source_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct sensor_device_attribute_2 *sattr = to_sensor_dev_attr_2(attr);
+	struct ccp_device *ccp = dev_get_drvdata(dev);
+	struct ccp_virt virt;
+	int len;
+	int i;
+
+	mutex_lock(&ccp->mutex);
+	virt = *ccp_virt_get(ccp, sattr->nr, sattr->index);
+	mutex_unlock(&ccp->mutex);
+
+	len = sysfs_emit(buf, "%s", ccp_virt_ops[virt.op]);
+	for (i = 0; i < virt.count; i++) {
+		len += sysfs_emit_at(buf, len, " %d", virt.src[i] + 1);
+		if (virt.op == CCP_VIRT_SUM)
+			len += sysfs_emit_at(buf, len, "*%d", virt.weight[i]);
+	}
+	len += sysfs_emit_at(buf, len, "\n");
+
+	return len;
+}
+
+static ssize_t virt_source_store(struct device *dev, struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct sensor_device_attribute_2 *sattr = to_sensor_dev_attr_2(attr);
+	struct ccp_device *ccp = dev_get_drvdata(dev);
+	struct ccp_virt virt;
+	char *str;
+	int ret;
+
+	str = kstrdup(buf, GFP_KERNEL);
+	if (!str)
+		return -ENOMEM;
+
+	ret = ccp_virt_parse(strim(str), ccp_sensors[sattr->nr].channels, &virt);
+	kfree(str);
+	if (ret)
+		return ret;
+
+	mutex_lock(&ccp->mutex);
+	*ccp_virt_get(ccp, sattr->nr, sattr->index) = virt;
+	mutex_unlock(&ccp->mutex);
+
+	return count;
+}
+
+static SENSOR_DEVICE_ATTR_2_RW(temp5_source, virt_source, CCP_TEMP_INPUT, 0);
+static SENSOR_DEVICE_ATTR_2_RW(temp6_source, virt_source, CCP_TEMP_INPUT, 1);
+static SENSOR_DEVICE_ATTR_2_RW(fan7_source, virt_source, CCP_FAN_INPUT, 0);
+static SENSOR_DEVICE_ATTR_2_RW(fan8_source, virt_source, CCP_FAN_INPUT, 1);
+
+static struct attribute *ccp_virt_attrs[] = {
+	&sensor_dev_attr_temp5_source.dev_attr.attr,
+	&sensor_dev_attr_temp6_source.dev_attr.attr,
+	&sensor_dev_attr_fan7_source.dev_attr.attr,
+	&sensor_dev_attr_fan8_source.dev_attr.attr,
+	NULL
+};
+
+static const struct attribute_group ccp_virt_group = {
+	.attrs = ccp_virt_attrs,
+};
+
+/* 1 once the fan settled at fan_target, 0 while it gets there or if it did not */
+static ssize_t target_reached_show(struct device *dev, struct device_attribute *attr,
+				   char *buf)
+{
+	struct ccp_device *ccp = dev_get_drvdata(dev);
+	int channel = to_sensor_dev_attr(attr)->index;
+	bool reached;
+
+	mutex_lock(&ccp->mutex);
+	if (ccp->target[channel] < 0) {
+		mutex_unlock(&ccp->mutex);
+		return -ENODATA;
+	}
+	reached = ccp->watch[channel].reached;
+	mutex_unlock(&ccp->mutex);
+
+	return sysfs_emit(buf, "%d\n", reached);
+}
+
+static ssize_t target_tolerance_show(struct device *dev, struct device_attribute *attr,
+				     char *buf)
+{
+	struct ccp_device *ccp = dev_get_drvdata(dev);
+	int channel = to_sensor_dev_attr(attr)->index;
+
+	return sysfs_emit(buf, "%d\n", READ_ONCE(ccp->watch[channel].tolerance));
+}
+
+static ssize_t target_tolerance_store(struct device *dev, struct device_attribute *attr,
+				      const char *buf, size_t count)
+{
+	struct ccp_device *ccp = dev_get_drvdata(dev);
+	int channel = to_sensor_dev_attr(attr)->index;
+	unsigned int val;
+	int ret;
+
+	ret = kstrtouint(buf, 10, &val);
+	if (ret)
+		return ret;
+	if (val > 0xffff)
+		return -EINVAL;
+
+	mutex_lock(&ccp->mutex);
+	ccp->watch[channel].tolerance = val;
+	mutex_unlock(&ccp->mutex);
+
+	return count;
+}
+
+static SENSOR_DEVICE_ATTR_RO(fan1_target_reached, target_reached, 0);
+static SENSOR_DEVICE_ATTR_RO(fan2_target_reached, target_reached, 1);
+static SENSOR_DEVICE_ATTR_RO(fan3_target_reached, target_reached, 2);
+static SENSOR_DEVICE_ATTR_RO(fan4_target_reached, target_reached, 3);
+static SENSOR_DEVICE_ATTR_RO(fan5_target_reached, target_reached, 4);
+static SENSOR_DEVICE_ATTR_RO(fan6_target_reached, target_reached, 5);
+static SENSOR_DEVICE_ATTR_RW(fan1_target_tolerance, target_tolerance, 0);
+static SENSOR_DEVICE_ATTR_RW(fan2_target_tolerance, target_tolerance, 1);
+static SENSOR_DEVICE_ATTR_RW(fan3_target_tolerance, target_tolerance, 2);
+static SENSOR_DEVICE_ATTR_RW(fan4_target_tolerance, target_tolerance, 3);
+static SENSOR_DEVICE_ATTR_RW(fan5_target_tolerance, target_tolerance, 4);
+static SENSOR_DEVICE_ATTR_RW(fan6_target_tolerance, target_tolerance, 5);
+
+static struct attribute *ccp_target_attrs[] = {
+	&sensor_dev_attr_fan1_target_reached.dev_attr.attr,
+	&sensor_dev_attr_fan2_target_reached.dev_attr.attr,
+	&sensor_dev_attr_fan3_target_reached.dev_attr.attr,
+	&sensor_dev_attr_fan4_target_reached.dev_attr.attr,
+	&sensor_dev_attr_fan5_target_reached.dev_attr.attr,
+	&sensor_dev_attr_fan6_target_reached.dev_attr.attr,
+	&sensor_dev_attr_fan1_target_tolerance.dev_attr.attr,
+	&sensor_dev_attr_fan2_target_tolerance.dev_attr.attr,
+	&sensor_dev_attr_fan3_target_tolerance.dev_attr.attr,
+	&sensor_dev_attr_fan4_target_tolerance.dev_attr.attr,
+	&sensor_dev_attr_fan5_target_tolerance.dev_attr.attr,
+	&sensor_dev_attr_fan6_target_tolerance.dev_attr.attr,
+	NULL
+};
+
+/* like the other fan attributes, only for connected fans */
+static umode_t ccp_target_is_visible(struct kobject *kobj, struct attribute *attr, int n)
+{
+	struct device_attribute *dattr = container_of(attr, struct device_attribute, attr);
+	struct ccp_device *ccp = dev_get_drvdata(kobj_to_dev(kobj));
+
+	if (!test_bit(to_sensor_dev_attr(dattr)->index, ccp->fan_cnct))
+		return 0;
+
+	return attr->mode;
+}
+
+static const struct attribute_group ccp_target_group = {
+	.attrs = ccp_target_attrs,
+	.is_visible = ccp_target_is_visible,
+};
+
+/*
+ * temp[1-4]_predicted and _uncertainty, in millidegree celsius. The device is only asked
+ * once the last sample is older than predict_interval.
+ */
+static ssize_t ccp_predict_show(struct device *dev, struct device_attribute *attr,
+				char *buf, bool uncertainty)
+{
+	struct ccp_device *ccp = dev_get_drvdata(dev);
+	int channel = to_sensor_dev_attr(attr)->index;
+	struct ccp_estimate *est = &ccp->estimate[channel];
+	unsigned int interval = READ_ONCE(ccp->predict_interval);
+	bool stale;
+	int temp;
+	int unc;
+	int ret;
+
+	if (!interval || test_bit(channel, &ccp->disabled[CCP_TEMP_INPUT]))
+		return -ENODATA;
+
+	mutex_lock(&ccp->mutex);
+	stale = !est->valid ||
+		time_after(jiffies, est->time + msecs_to_jiffies(interval));
+	mutex_unlock(&ccp->mutex);
+
+	if (stale) {
+		ret = get_sensor(ccp, CCP_TEMP_INPUT, channel);
+		if (ret < 0)
+			return ret;
+	}
+
+	mutex_lock(&ccp->mutex);
+	if (!est->valid) {
+		mutex_unlock(&ccp->mutex);
+		return -ENODATA;
+	}
+	ccp_estimate(est, &temp, &unc);
+	mutex_unlock(&ccp->mutex);
+
+	return sysfs_emit(buf, "%d\n", uncertainty ? unc : temp);
+}
+
+static ssize_t predicted_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return ccp_predict_show(dev, attr, buf, false);
+}
+
+static ssize_t uncertainty_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return ccp_predict_show(dev, attr, buf, true);
+}
+
+static ssize_t predict_interval_show(struct device *dev, struct device_attribute *attr,
+				     char *buf)
+{
+	struct ccp_device *ccp = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(ccp->predict_interval));
+}
+
+static ssize_t predict_interval_store(struct device *dev, struct device_attribute *attr,
+				      const char *buf, size_t count)
+{
+	struct ccp_device *ccp = dev_get_drvdata(dev);
+	unsigned int val;
+	int ret;
+
+	ret = kstrtouint(buf, 10, &val);
+	if (ret)
+		return ret;
+	if (val > PREDICT_INTERVAL_MAX)
+		return -EINVAL;
+
+	WRITE_ONCE(ccp->predict_interval, val);
+
+	return count;
+}
+
+static SENSOR_DEVICE_ATTR_RO(temp1_predicted, predicted, 0);
+static SENSOR_DEVICE_ATTR_RO(temp2_predicted, predicted, 1);
+static SENSOR_DEVICE_ATTR_RO(temp3_predicted, predicted, 2);
+static SENSOR_DEVICE_ATTR_RO(temp4_predicted, predicted, 3);
+static SENSOR_DEVICE_ATTR_RO(temp1_uncertainty, uncertainty, 0);
+static SENSOR_DEVICE_ATTR_RO(temp2_uncertainty, uncertainty, 1);
+static SENSOR_DEVICE_ATTR_RO(temp3_uncertainty, uncertainty, 2);
+static SENSOR_DEVICE_ATTR_RO(temp4_uncertainty, uncertainty, 3);
+static DEVICE_ATTR_RW(predict_interval);
+
+static struct attribute *ccp_predict_attrs[] = {
+	&sensor_dev_attr_temp1_predicted.dev_attr.attr,
+	&sensor_dev_attr_temp2_predicted.dev_attr.attr,
+	&sensor_dev_attr_temp3_predicted.dev_attr.attr,
+	&sensor_dev_attr_temp4_predicted.dev_attr.attr,
+	&sensor_dev_attr_temp1_uncertainty.dev_attr.attr,
+	&sensor_dev_attr_temp2_uncertainty.dev_attr.attr,
+	&sensor_dev_attr_temp3_uncertainty.dev_attr.attr,
+	&sensor_dev_attr_temp4_uncertainty.dev_attr.attr,
+	&dev_attr_predict_interval.attr,
+	NULL
+};
+
+/* the per channel attributes only for connected sensors */
+static umode_t ccp_predict_is_visible(struct kobject *kobj, struct attribute *attr, int n)
+{
+	struct device_attribute *dattr = container_of(attr, struct device_attribute, attr);
+	struct ccp_device *ccp = dev_get_drvdata(kobj_to_dev(kobj));
+
+	if (attr != &dev_attr_predict_interval.attr &&
+	    !test_bit(to_sensor_dev_attr(dattr)->index, ccp->temp_cnct))
+		return 0;
+
+	return attr->mode;
+}
+
+static const struct attribute_group ccp_predict_group = {
+	.attrs = ccp_predict_attrs,
+	.is_visible = ccp_predict_is_visible,
+};
+
+/*
+ * The optimizer holds a temperature channel at a target by the fans with a weight. It
+ * keeps the cooling effort, the weighted rpm sum, and changes it only while the cached
+ * temperature is more than OPT_HYSTERESIS off. Each change is split over the fans:
+ * "rpm" runs the fans with the most cooling per rpm first, "noise" spreads the effort
+ * in proportion to the weights, which minimizes the sum of squared rpm. The calibration
+ * of a fan maps the rpm back to a duty cycle.
+ */
+static int ccp_opt_min(const struct ccp_opt_fan *fan)
+{
+	return fan->rpm[0];
+}
+
+static int ccp_opt_max(const struct ccp_opt_fan *fan)
+{
+	return fan->rpm[OPT_CAL_POINTS - 1];
+}
+
+static bool ccp_opt_used(const struct ccp_opt_fan *fan)
+{
+	return fan->weight && fan->calibrated;
+}
+
+/* duty in percent that gives rpm, from the calibration */
+static int ccp_opt_duty(const struct ccp_opt_fan *fan, int rpm)
+{
+	int step = 100 / (OPT_CAL_POINTS - 1);
+	int i;
+
+	if (rpm <= fan->rpm[0])
+		return 0;
+
+	for (i = 1; i < OPT_CAL_POINTS; i++) {
+		if (rpm > fan->rpm[i])
+			continue;
+		return (i - 1) * step + DIV_ROUND_UP((rpm - fan->rpm[i - 1]) * step,
+						     fan->rpm[i] - fan->rpm[i - 1]);
+	}
+
+	return 100;
+}
+
+/* weighted rpm of the fans at rpm = lambda * weight, clamped to their range */
+static s64 ccp_opt_noise_effort(const struct ccp_optimizer *opt, int lambda, int *rpm)
+{
+	const struct ccp_opt_fan *fan;
+	s64 effort = 0;
+	int i;
+
+	for (i = 0; i < NUM_FANS; i++) {
+		fan = &opt->fans[i];
+		if (!ccp_opt_used(fan))
+			continue;
+		rpm[i] = clamp_t(s64, div_s64((s64)lambda * fan->weight, OPT_WEIGHT_MAX),
+				 ccp_opt_min(fan), ccp_opt_max(fan));
+		effort += (s64)fan->weight * rpm[i];
+	}
+
+	return div_s64(effort, OPT_WEIGHT_MAX);
+}
+
+static void ccp_opt_split(const struct ccp_optimizer *opt, int *rpm)
+{
+	const struct ccp_opt_fan *fan;
+	int effort = opt->effort;
+	int best;
+	int add;
+	int lo;
+	int hi;
+	int i;
+	int mid;
+	unsigned long done = 0;
+
+	if (opt->mode == CCP_OPT_NOISE) {
+		/* the largest lambda not exceeding the effort */
+		lo = 0;
+		hi = 0xffff * OPT_WEIGHT_MAX;
+		while (lo < hi) {
+			mid = lo + (hi - lo + 1) / 2;
+			if (ccp_opt_noise_effort(opt, mid, rpm) <= effort)
+				lo = mid;
+			else
+				hi = mid - 1;
+		}
+		ccp_opt_noise_effort(opt, lo, rpm);
+		return;
+	}
+
+	for (i = 0; i < NUM_FANS; i++) {
+		fan = &opt->fans[i];
+		if (!ccp_opt_used(fan))
+			continue;
+		rpm[i] = ccp_opt_min(fan);
+		effort -= fan->weight * rpm[i] / OPT_WEIGHT_MAX;
+	}
+
+	/* the fans with most cooling per rpm speed up first */
+	while (effort > 0) {
+		best = -1;
+		for (i = 0; i < NUM_FANS; i++)
+			if (ccp_opt_used(&opt->fans[i]) && !test_bit(i, &done) &&
+			    (best < 0 || opt->fans[i].weight > opt->fans[best].weight))
+				best = i;
+		if (best < 0)
+			break;
+
+		fan = &opt->fans[best];
+		add = min(DIV_ROUND_UP(effort * OPT_WEIGHT_MAX, fan->weight),
+			  ccp_opt_max(fan) - rpm[best]);
+		rpm[best] += add;
+		effort -= add * fan->weight / OPT_WEIGHT_MAX;
+		set_bit(best, &done);
+	}
+}
+
+/* must be called with ccp->mutex held, sends the duty of the fans which changed */
+static void ccp_opt_apply(struct ccp_device *ccp)
+{
+	struct ccp_optimizer *opt = &ccp->opt;
+	struct ccp_cmd *cmds = ccp->sweep_cmds;
+	int channels[NUM_FANS];
+	int rpm[NUM_FANS];
+	struct ccp_sensor *sensor;
+	int count = 0;
+	int duty;
+	int i;
+
+	ccp_opt_split(opt, rpm);
+
+	for (i = 0; i < NUM_FANS; i++) {
+		if (!ccp_opt_used(&opt->fans[i]))
+			continue;
+		duty = ccp_opt_duty(&opt->fans[i], rpm[i]);
+		if (duty == opt->fans[i].duty)
+			continue;
+		opt->fans[i].duty = duty;
+		ccp_cmd_init(&cmds[count], CTL_SET_FAN_FPWM, i, duty, 0);
+		channels[count++] = i;
+	}
+
+	ccp_core_submit(&ccp->core, cmds, count);
+
+	for (i = 0; i < count; i++) {
+		sensor = &ccp->sensors[CCP_PWM_INPUT][channels[i]];
+		if (cmds[i].status || ccp_core_errno(&ccp->core, &cmds[i])) {
+			/* sent again next time */
+			opt->fans[channels[i]].duty = -1;
+			continue;
+		}
+		ccp->target[channels[i]] = -ENODATA;
+		ccp->pwm_enable[channels[i]] = CCP_PWM_MANUAL;
+		sensor->value = opt->fans[channels[i]].duty;
+		sensor->updated = jiffies;
+		sensor->valid = true;
+	}
+}
+
+static void ccp_opt_work(struct work_struct *work)
+{
+	struct ccp_optimizer *opt = container_of(to_delayed_work(work), struct ccp_optimizer,
+						 work);
+	struct ccp_device *ccp = container_of(opt, struct ccp_device, opt);
+	int min_effort = 0;
+	int max_effort = 0;
+	long temp;
+	int dev;
+	int ret;
+	int i;
+
+	mutex_lock(&ccp->mutex);
+	i = opt->temp;
+	mutex_unlock(&ccp->mutex);
+	if (i < 0)
+		return;
+
+	ret = ccp_read(ccp->hwmon_dev, hwmon_temp, hwmon_temp_input, i, &temp);
+
+	mutex_lock(&ccp->mutex);
+	if (opt->stop || opt->temp < 0)
+		goto out_unlock;
+
+	/* without a reading the fans keep their speed */
+	if (!ret) {
+		for (i = 0; i < NUM_FANS; i++) {
+			if (!ccp_opt_used(&opt->fans[i]))
+				continue;
+			min_effort += opt->fans[i].weight * ccp_opt_min(&opt->fans[i]) /
+				      OPT_WEIGHT_MAX;
+			max_effort += opt->fans[i].weight * ccp_opt_max(&opt->fans[i]) /
+				      OPT_WEIGHT_MAX;
+		}
+
+		dev = temp - opt->target;
+		if (abs(dev) > OPT_HYSTERESIS) {
+			opt->effort = clamp(opt->effort + dev / OPT_GAIN, min_effort, max_effort);
+			ccp_opt_apply(ccp);
+		}
+	}
+
+	schedule_delayed_work(&opt->work, SENSOR_CACHE_TIME);
+out_unlock:
+	mutex_unlock(&ccp->mutex);
+}
+
+/* "off" or "<temp channel> <target> <rpm|noise>" */
+static ssize_t optimize_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct ccp_device *ccp = dev_get_drvdata(dev);
+	struct ccp_optimizer *opt = &ccp->opt;
+	ssize_t ret;
+
+	mutex_lock(&ccp->mutex);
+	if (opt->temp < 0)
+		ret = sysfs_emit(buf, "off\n");
+	else
+		ret = sysfs_emit(buf, "%d %d %s\n", opt->temp + 1, opt->target,
+				 ccp_opt_modes[opt->mode]);
+	mutex_unlock(&ccp->mutex);
+
+	return ret;
+}
+
+/* temp is the hwmon channel starting at 0, negative to switch the optimizer off */
+static int ccp_opt_set(struct ccp_device *ccp, int temp, int target, enum ccp_opt_mode mode)
+{
+	struct ccp_optimizer *opt = &ccp->opt;
+	int rpm[NUM_FANS];
+	int i;
+
+	if (temp < 0) {
+		mutex_lock(&ccp->mutex);
+		opt->temp = -1;
+		mutex_unlock(&ccp->mutex);
+		return 0;
+	}
+
+	/* a missing reading must not pass for a cold one */
+	if (!ccp_temp_usable(ccp, temp))
+		return -ENODATA;
+
+	/* from the cache, one sweep at most */
+	for (i = 0; i < NUM_FANS; i++)
+		rpm[i] = ccp_connected(ccp, &ccp_sensors[CCP_FAN_INPUT], i) ?
+			 get_sensor(ccp, CCP_FAN_INPUT, i) : -ENODATA;
+
+	mutex_lock(&ccp->mutex);
+	if (opt->temp < 0) {
+		/* start from the current speed of the fans */
+		opt->effort = 0;
+		for (i = 0; i < NUM_FANS; i++) {
+			opt->fans[i].duty = -1;
+			if (ccp_opt_used(&opt->fans[i]) && rpm[i] > 0)
+				opt->effort += opt->fans[i].weight * rpm[i] / OPT_WEIGHT_MAX;
+		}
+	}
+	opt->temp = temp;
+	opt->target = target;
+	opt->mode = mode;
+	if (!opt->stop)
+		mod_delayed_work(system_wq, &opt->work, 0);
+	mutex_unlock(&ccp->mutex);
+
+	return 0;
+}
+
+static ssize_t optimize_store(struct device *dev, struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+	struct ccp_device *ccp = dev_get_drvdata(dev);
+	char mode[8];
+	int target;
+	int temp;
+	int ret;
+
+	if (sysfs_streq(buf, "off")) {
+		ccp_opt_set(ccp, -1, 0, CCP_OPT_RPM);
+		return count;
+	}
+
+	if (sscanf(buf, "%d %d %7s", &temp, &target, mode) != 3)
+		return -EINVAL;
+	if (temp < 1 || temp > NUM_TEMP_SENSORS + NUM_VIRT_CHANNELS)
+		return -EINVAL;
+	ret = match_string(ccp_opt_modes, ARRAY_SIZE(ccp_opt_modes), mode);
+	if (ret < 0)
+		return ret;
+
+	ret = ccp_opt_set(ccp, temp - 1, target, ret);
+
+	return ret ? ret : count;
+}
+
+/* rpm at 0, 20, 40, 60, 80 and 100 % duty, rising, or "none" */
+static ssize_t opt_calibration_show(struct device *dev, struct device_attribute *attr,
+				    char *buf)
+{
+	struct ccp_device *ccp = dev_get_drvdata(dev);
+	struct ccp_opt_fan *fan = &ccp->opt.fans[to_sensor_dev_attr(attr)->index];
+	ssize_t ret;
+
+	mutex_lock(&ccp->mutex);
+	if (!fan->calibrated)
+		ret = sysfs_emit(buf, "none\n");
+	else
+		ret = sysfs_emit(buf, "%u %u %u %u %u %u\n", fan->rpm[0], fan->rpm[1],
+				 fan->rpm[2], fan->rpm[3], fan->rpm[4], fan->rpm[5]);
+	mutex_unlock(&ccp->mutex);
+
+	return ret;
+}
+
+static ssize_t opt_calibration_store(struct device *dev, struct device_attribute *attr,
+				     const char *buf, size_t count)
+{
+	struct ccp_device *ccp = dev_get_drvdata(dev);
+	struct ccp_opt_fan *fan = &ccp->opt.fans[to_sensor_dev_attr(attr)->index];
+	u16 rpm[OPT_CAL_POINTS];
+	bool calibrated = false;
+	int i;
+
+	if (!sysfs_streq(buf, "none")) {
+		if (sscanf(buf, "%hu %hu %hu %hu %hu %hu", &rpm[0], &rpm[1], &rpm[2],
+			   &rpm[3], &rpm[4], &rpm[5]) != OPT_CAL_POINTS)
+			return -EINVAL;
+		for (i = 1; i < OPT_CAL_POINTS; i++)
+			if (rpm[i] <= rpm[i - 1])
+				return -EINVAL;
+		calibrated = true;
+	}
+
+	mutex_lock(&ccp->mutex);
+	if (calibrated)
+		memcpy(fan->rpm, rpm, sizeof(rpm));
+	fan->calibrated = calibrated;
+	mutex_unlock(&ccp->mutex);
+
+	return count;
+}
+
+static ssize_t opt_weight_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct ccp_device *ccp = dev_get_drvdata(dev);
+	int channel = to_sensor_dev_attr(attr)->index;
+
+	return sysfs_emit(buf, "%d\n", READ_ONCE(ccp->opt.fans[channel].weight));
+}
+
+static ssize_t opt_weight_store(struct device *dev, struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	struct ccp_device *ccp = dev_get_drvdata(dev);
+	int channel = to_sensor_dev_attr(attr)->index;
+	unsigned int val;
+	int ret;
+
+	ret = kstrtouint(buf, 10, &val);
+	if (ret)
+		return ret;
+	if (val > OPT_WEIGHT_MAX)
+		return -EINVAL;
+
+	mutex_lock(&ccp->mutex);
+	ccp->opt.fans[channel].weight = val;
+	mutex_unlock(&ccp->mutex);
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(optimize);
+static SENSOR_DEVICE_ATTR_RW(pwm1_calibration, opt_calibration, 0);
+static SENSOR_DEVICE_ATTR_RW(pwm2_calibration, opt_calibration, 1);
+static SENSOR_DEVICE_ATTR_RW(pwm3_calibration, opt_calibration, 2);
+static SENSOR_DEVICE_ATTR_RW(pwm4_calibration, opt_calibration, 3);
+static SENSOR_DEVICE_ATTR_RW(pwm5_calibration, opt_calibration, 4);
+static SENSOR_DEVICE_ATTR_RW(pwm6_calibration, opt_calibration, 5);
+static SENSOR_DEVICE_ATTR_RW(pwm1_opt_weight, opt_weight, 0);
+static SENSOR_DEVICE_ATTR_RW(pwm2_opt_weight, opt_weight, 1);
+static SENSOR_DEVICE_ATTR_RW(pwm3_opt_weight, opt_weight, 2);
+static SENSOR_DEVICE_ATTR_RW(pwm4_opt_weight, opt_weight, 3);
+static SENSOR_DEVICE_ATTR_RW(pwm5_opt_weight, opt_weight, 4);
+static SENSOR_DEVICE_ATTR_RW(pwm6_opt_weight, opt_weight, 5);
+
+static struct attribute *ccp_opt_attrs[] = {
+	&dev_attr_optimize.attr,
+	&sensor_dev_attr_pwm1_calibration.dev_attr.attr,
+	&sensor_dev_attr_pwm2_calibration.dev_attr.attr,
+	&sensor_dev_attr_pwm3_calibration.dev_attr.attr,
+	&sensor_dev_attr_pwm4_calibration.dev_attr.attr,
+	&sensor_dev_attr_pwm5_calibration.dev_attr.attr,
+	&sensor_dev_attr_pwm6_calibration.dev_attr.attr,
+	&sensor_dev_attr_pwm1_opt_weight.dev_attr.attr,
+	&sensor_dev_attr_pwm2_opt_weight.dev_attr.attr,
+	&sensor_dev_attr_pwm3_opt_weight.dev_attr.attr,
+	&sensor_dev_attr_pwm4_opt_weight.dev_attr.attr,
+	&sensor_dev_attr_pwm5_opt_weight.dev_attr.attr,
+	&sensor_dev_attr_pwm6_opt_weight.dev_attr.attr,
+	NULL
+};
+
+/* the per fan attributes only for connected fans */
+static umode_t ccp_opt_is_visible(struct kobject *kobj, struct attribute *attr, int n)
+{
+	struct device_attribute *dattr = container_of(attr, struct device_attribute, attr);
+	struct ccp_device *ccp = dev_get_drvdata(kobj_to_dev(kobj));
+
+	if (attr != &dev_attr_optimize.attr &&
+	    !test_bit(to_sensor_dev_attr(dattr)->index, ccp->fan_cnct))
+		return 0;
+
+	return attr->mode;
+}
+
+static const struct attribute_group ccp_opt_group = {
+	.attrs = ccp_opt_attrs,
+	.is_visible = ccp_opt_is_visible,
+};
+
+static void ccp_opt_init(struct ccp_device *ccp)
+{
+	ccp->opt.temp = -1;
+	INIT_DELAYED_WORK(&ccp->opt.work, ccp_opt_work);
+}
+
+/* the optimizer reads the temperature through the hwmon device */
+static void ccp_opt_stop(struct ccp_device *ccp)
+{
+	mutex_lock(&ccp->mutex);
+	ccp->opt.stop = true;
+	mutex_unlock(&ccp->mutex);
+	cancel_delayed_work_sync(&ccp->opt.work);
+}
+
+/*
+ * Fan and optimizer settings exported through the state attribute. Reading it before
+ * unloading the module and writing it back after loading restores them, the fans in one
+ * batch. All fields are little endian.
+ */
+#define CCP_STATE_MAGIC		0x53504343	/* "CCPS" */
+#define CCP_STATE_VERSION	2
+
+#define CCP_STATE_PWM		BIT(0)	/* pwm holds a fixed duty cycle */
+#define CCP_STATE_TARGET	BIT(1)	/* target holds a target rpm */
+#define CCP_STATE_CALIBRATED	BIT(2)	/* opt_rpm holds a calibration */
+
+struct ccp_state_fan {
+	s8 pwm_enable;		/* negative if unknown */
+	u8 flags;
+	u8 pwm;			/* in percent */
+	u8 sensor;		/* fan curve temperature sensor */
+	__le16 target;
+	__le16 rpm[NUM_CURVE_POINTS];
+	__le32 temp[NUM_CURVE_POINTS];	/* in millidegree celsius */
+	__le16 opt_rpm[OPT_CAL_POINTS];
+	__le16 opt_weight;
+} __packed;
+
+struct ccp_state {
+	__le32 magic;
+	u8 version;
+	u8 num_fans;
+	u8 reserved[2];
+	struct ccp_state_fan fans[NUM_FANS];
+	s8 opt_temp;		/* negative if the optimizer is off */
+	u8 opt_mode;
+	u8 reserved2[2];
+	__le32 opt_target;
+} __packed;
+
+static void ccp_state_export(struct ccp_device *ccp, struct ccp_state *state)
+{
+	const struct ccp_sensor *pwm;
+	struct ccp_state_fan *fan;
+	int channel;
+	int i;
+
+	memset(state, 0, sizeof(*state));
+	state->magic = cpu_to_le32(CCP_STATE_MAGIC);
+	state->version = CCP_STATE_VERSION;
+	state->num_fans = NUM_FANS;
+
+	for (channel = 0; channel < NUM_FANS; channel++) {
+		fan = &state->fans[channel];
+		pwm = &ccp->sensors[CCP_PWM_INPUT][channel];
+
+		fan->pwm_enable = ccp->pwm_enable[channel] < 0 ? -1 : ccp->pwm_enable[channel];
+		if (ccp->target[channel] >= 0) {
+			fan->flags |= CCP_STATE_TARGET;
+			fan->target = cpu_to_le16(ccp->target[channel]);
+		} else if (pwm->valid && pwm->value >= 0) {
+			fan->flags |= CCP_STATE_PWM;
+			fan->pwm = pwm->value;
+		}
+
+		fan->sensor = ccp->curve[channel].sensor;
+		for (i = 0; i < NUM_CURVE_POINTS; i++) {
+			fan->rpm[i] = cpu_to_le16(ccp->curve[channel].rpm[i]);
+			fan->temp[i] = cpu_to_le32(ccp->curve[channel].temp[i]);
+		}
+
+		if (ccp->opt.fans[channel].calibrated) {
+			fan->flags |= CCP_STATE_CALIBRATED;
+			for (i = 0; i < OPT_CAL_POINTS; i++)
+				fan->opt_rpm[i] = cpu_to_le16(ccp->opt.fans[channel].rpm[i]);
+		}
+		fan->opt_weight = cpu_to_le16(ccp->opt.fans[channel].weight);
+	}
+
+	state->opt_temp = ccp->opt.temp < 0 ? -1 : ccp->opt.temp;
+	state->opt_mode = ccp->opt.mode;
+	state->opt_target = cpu_to_le32(ccp->opt.target);
+}
+
+static void ccp_state_curve(const struct ccp_state_fan *fan, struct ccp_fan_curve *curve)
+{
+	int i;
+
+	curve->sensor = fan->sensor;
+	for (i = 0; i < NUM_CURVE_POINTS; i++) {
+		curve->rpm[i] = le16_to_cpu(fan->rpm[i]);
+		curve->temp[i] = le32_to_cpu(fan->temp[i]);
+	}
+}
+
+/* builds the command restoring the mode of one fan, returns false if nothing has to be sent */
+static bool ccp_state_fan_cmd(struct ccp_device *ccp, int channel,
+			      const struct ccp_state_fan *fan, struct ccp_cmd *cmd)
+{
+	struct ccp_fan_curve curve;
+	int target;
+
+	if (!test_bit(channel, ccp->fan_cnct))
+		return false;
+
+	switch (fan->pwm_enable) {
+	case CCP_PWM_FULL:
+		ccp_cmd_init(cmd, CTL_SET_FAN_FPWM, channel, 100, 0);
+		return true;
+	case CCP_PWM_MANUAL:
+		if (fan->flags & CCP_STATE_TARGET) {
+			target = le16_to_cpu(fan->target);
+			ccp_cmd_init(cmd, CTL_SET_FAN_TARGET, channel, target >> 8, target);
+			return true;
+		}
+		if (fan->flags & CCP_STATE_PWM) {
+			ccp_cmd_init(cmd, CTL_SET_FAN_FPWM, channel, min_t(u8, fan->pwm, 100), 0);
+			return true;
+		}
+		return false;
+	case CCP_PWM_CURVE:
+		ccp_state_curve(fan, &curve);
+		return (ccp->caps & CCP_CAP_FAN_CURVE) && !fan_curve_cmd(&curve, channel, cmd);
+	default:
+		return false;
+	}
+}
+
+/*
+ * takes over the settings of one fan once they reached the device, sent tells whether a
+ * command of ccp_state_fan_cmd() was needed for it
+ */
+static void ccp_state_apply_fan(struct ccp_device *ccp, int channel,
+				const struct ccp_state_fan *fan, bool sent)
+{
+	struct ccp_sensor *pwm = &ccp->sensors[CCP_PWM_INPUT][channel];
+	struct ccp_opt_fan *opt = &ccp->opt.fans[channel];
+	int i;
+
+	opt->calibrated = fan->flags & CCP_STATE_CALIBRATED;
+	if (opt->calibrated)
+		for (i = 0; i < OPT_CAL_POINTS; i++)
+			opt->rpm[i] = le16_to_cpu(fan->opt_rpm[i]);
+	opt->weight = le16_to_cpu(fan->opt_weight);
+	ccp_state_curve(fan, &ccp->curve[channel]);
+
+	if (!sent)
+		return;
+
+	ccp->target[channel] = -ENODATA;
+	switch (fan->pwm_enable) {
+	case CCP_PWM_FULL:
+		pwm->value = 100;
+		break;
+	case CCP_PWM_MANUAL:
+		if (fan->flags & CCP_STATE_TARGET) {
+			pwm->value = -ENODATA;
+			ccp->target[channel] = le16_to_cpu(fan->target);
+			/* like fan_target, fan_target_reached follows the restored target */
+			ccp_target_watch(ccp, channel);
+		} else {
+			pwm->value = min_t(u8, fan->pwm, 100);
+		}
+		break;
+	case CCP_PWM_CURVE:
+		pwm->value = -ENODATA;
+		break;
+	}
+
+	ccp->pwm_enable[channel] = fan->pwm_enable;
+	pwm->updated = jiffies;
+	pwm->valid = true;
+}
+
+/*
+ * the limits of pwm[1-6]_auto_channels_temp, pwm[1-6]_auto_point[1-6]_temp,
+ * pwm[1-6]_calibration, pwm[1-6]_opt_weight and optimize
+ */
+static bool ccp_state_valid(const struct ccp_state *state)
+{
+	const struct ccp_state_fan *fan;
+	int channel;
+	int i;
+
+	if (le32_to_cpu(state->magic) != CCP_STATE_MAGIC ||
+	    state->version != CCP_STATE_VERSION || state->num_fans != NUM_FANS)
+		return false;
+
+	for (channel = 0; channel < NUM_FANS; channel++) {
+		fan = &state->fans[channel];
+		if (fan->sensor >= NUM_TEMP_SENSORS)
+			return false;
+		for (i = 0; i < NUM_CURVE_POINTS; i++)
+			if (le32_to_cpu(fan->temp[i]) > 655350)
+				return false;
+		if (le16_to_cpu(fan->opt_weight) > OPT_WEIGHT_MAX)
+			return false;
+		if (fan->flags & CCP_STATE_CALIBRATED)
+			for (i = 1; i < OPT_CAL_POINTS; i++)
+				if (le16_to_cpu(fan->opt_rpm[i]) <= le16_to_cpu(fan->opt_rpm[i - 1]))
+					return false;
+	}
+
+	if (state->opt_temp < -1 || state->opt_temp >= NUM_TEMP_SENSORS + NUM_VIRT_CHANNELS ||
+	    state->opt_mode >= ARRAY_SIZE(ccp_opt_modes))
+		return false;
+
+	return true;
+}
+
+/*
+ * sends the settings of all connected fans as one batch, then sets the optimizer. The
+ * driver takes over the settings of a fan only once its command succeeded.
+ */
+static int ccp_state_import(struct ccp_device *ccp, const struct ccp_state *state)
+{
+	struct ccp_cmd *cmds = ccp->sweep_cmds;
+	struct ccp_cmd *cmd;
+	int index[NUM_FANS];
+	int count = 0;
+	int channel;
+	int ret = 0;
+	int err;
+
+	/* nothing is changed by a bad blob */
+	if (!ccp_state_valid(state))
+		return -EINVAL;
+	if (state->opt_temp >= 0 && !ccp_temp_usable(ccp, state->opt_temp))
+		return -ENODATA;
+
+	mutex_lock(&ccp->mutex);
+
+	for (channel = 0; channel < NUM_FANS; channel++) {
+		index[channel] = -1;
+		if (ccp_state_fan_cmd(ccp, channel, &state->fans[channel], &cmds[count]))
+			index[channel] = count++;
+	}
+
+	ccp_core_submit(&ccp->core, cmds, count);
+
+	for (channel = 0; channel < NUM_FANS; channel++) {
+		if (index[channel] < 0) {
+			ccp_state_apply_fan(ccp, channel, &state->fans[channel], false);
+			continue;
+		}
+
+		cmd = &cmds[index[channel]];
+		err = cmd->status ? cmd->status : ccp_core_errno(&ccp->core, cmd);
+		if (!err) {
+			ccp_state_apply_fan(ccp, channel, &state->fans[channel], true);
+			continue;
+		}
+
+		/* the mode of a fan whose command failed is unknown, its settings are kept */
+		ret = err;
+		if (err == -EOPNOTSUPP && state->fans[channel].pwm_enable == CCP_PWM_CURVE)
+			ccp->caps &= ~CCP_CAP_FAN_CURVE;
+		ccp->pwm_enable[channel] = -ENODATA;
+		ccp->target[channel] = -ENODATA;
+		ccp->sensors[CCP_PWM_INPUT][channel].valid = false;
+	}
+
+	mutex_unlock(&ccp->mutex);
+
+	err = ccp_opt_set(ccp, state->opt_temp, (s32)le32_to_cpu(state->opt_target),
+			  state->opt_mode);
+
+	return ret ? ret : err;
+}
+
+static ssize_t state_read(struct file *file, struct kobject *kobj,
+			  const struct bin_attribute *attr, char *buf, loff_t off, size_t count)
+{
+	struct ccp_device *ccp = dev_get_drvdata(kobj_to_dev(kobj));
+	struct ccp_state state;
+
+	mutex_lock(&ccp->mutex);
+	ccp_state_export(ccp, &state);
+	mutex_unlock(&ccp->mutex);
+
+	return memory_read_from_buffer(buf, count, &off, &state, sizeof(state));
+}
+
+static ssize_t state_write(struct file *file, struct kobject *kobj,
+			   const struct bin_attribute *attr, char *buf, loff_t off, size_t count)
+{
+	struct ccp_device *ccp = dev_get_drvdata(kobj_to_dev(kobj));
+	int ret;
+
+	/* only whole blobs, as read from the attribute */
+	if (off || count != sizeof(struct ccp_state))
+		return -EINVAL;
+
+	ret = ccp_state_import(ccp, (const struct ccp_state *)buf);
+
+	return ret ? ret : count;
+}
+
+static BIN_ATTR_RW(state, sizeof(struct ccp_state));
+
+static const struct bin_attribute *const ccp_state_attrs[] = {
+	&bin_attr_state,
+	NULL
+};
+
+static const struct attribute_group ccp_state_group = {
+	.bin_attrs = ccp_state_attrs,
+};
+
+static const struct attribute_group *ccp_groups[] = {
+	&ccp_curve_group,
+	&ccp_virt_group,
+	&ccp_target_group,
+	&ccp_predict_group,
+	&ccp_opt_group,
+	&ccp_state_group,
+	NULL
+};
+
+/* curve used until pwmX_auto_point* is written, 25 to 50 degrees, 600 to 2000 rpm */
+static void ccp_init_curves(struct ccp_device *ccp)
+{
+	static const u16 rpm[NUM_CURVE_POINTS] = { 600, 800, 1000, 1300, 1600, 2000 };
+	int channel;
+	int i;
+
+	for (channel = 0; channel < NUM_FANS; channel++) {
+		ccp->pwm_enable[channel] = -ENODATA;
+		for (i = 0; i < NUM_CURVE_POINTS; i++) {
+			ccp->curve[channel].temp[i] = 25000 + 5000 * i;
+			ccp->curve[channel].rpm[i] = rpm[i];
+		}
+	}
+}
+
+/*
+ * Led colors are uploaded per component in frames of up to LED_DIRECT_MAX leds. Only
+ * leds changed since the last upload are sent: a frame starts at the next changed led
+ * and ends after the last changed one it can hold, so few changing leds cost few
+ * frames. Frames of one upload are sent as one batch, which is either sent whole or
+ * dropped whole when its deadline passes. Must be called with led_mutex held.
+ */
+static int ccp_led_send(struct ccp_device *ccp, int channel, const u8 *rgb, int count,
+			enum ccp_prio prio, ktime_t deadline)
+{
+	struct ccp_led_channel *led = &ccp->leds[channel];
+	struct ccp_cmd *cmds = ccp->led_cmds;
+	int num_cmds = 0;
+	int first;
+	int comp;
+	int ret = 0;
+	int end;
+	int i;
+	int j;
+
+	lockdep_assert_held(&ccp->led_mutex);
+
+	if (!led->direct)
+		ccp_cmd_init(&cmds[num_cmds++], CTL_SET_LED_PORT_STATE, channel, 2, 0);
+	first = num_cmds;
+
+	for (comp = 0; comp < 3; comp++) {
+		for (i = 0; i < count; i = end) {
+			/* next changed led */
+			while (i < count && i < led->count &&
+			       rgb[3 * i + comp] == led->shadow[comp][i])
+				i++;
+			if (i == count)
+				break;
+
+			/* last changed led the frame can hold */
+			end = min(i + LED_DIRECT_MAX, count);
+			while (end > i + 1 && end <= led->count &&
+			       rgb[3 * (end - 1) + comp] == led->shadow[comp][end - 1])
+				end--;
+
+			ccp_cmd_init(&cmds[num_cmds], CTL_SET_LED_DIRECT, channel, i, end - i);
+			cmds[num_cmds].out[4] = comp;
+			for (j = i; j < end; j++)
+				cmds[num_cmds].out[5 + j - i] = rgb[3 * j + comp];
+			num_cmds++;
+		}
+	}
+
+	ccp->led_stats.frames++;
+	ccp->led_stats.reports_full += 3 * DIV_ROUND_UP(count, LED_DIRECT_MAX) + 1;
+
+	/* nothing changed */
+	if (num_cmds == first)
+		return 0;
+
+	ccp_cmd_init(&cmds[num_cmds++], CTL_LED_COMMIT, 0xff, 0, 0);
+	for (i = 0; i < num_cmds; i++)
+		cmds[i].deadline = deadline;
+	ccp_core_submit_prio(&ccp->core, cmds, num_cmds, prio);
+	ccp->led_stats.reports += num_cmds;
+
+	for (i = 0; i < num_cmds; i++) {
+		ret = cmds[i].status ? cmds[i].status : ccp_core_errno(&ccp->core, &cmds[i]);
+		if (ret)
+			break;
+	}
+
+	/* the whole upload expired unsent, the leds still show the shadow */
+	if (ret == -ETIME)
+		return ret;
+
+	if (ret) {
+		/* unknown what the leds show now, send everything next time */
+		led->direct = false;
+		led->count = 0;
+		return ret;
+	}
+
+	led->direct = true;
+	for (i = 0; i < count; i++)
+		for (comp = 0; comp < 3; comp++)
+			led->shadow[comp][i] = rgb[3 * i + comp];
+	led->count = max(led->count, count);
+
+	return 0;
+}
+
+static int ccp_led_upload(struct ccp_device *ccp, int channel, const u8 *rgb, int count,
+			  enum ccp_prio prio, ktime_t deadline)
+{
+	int ret;
+
+	mutex_lock(&ccp->led_mutex);
+	ret = ccp_led_send(ccp, channel, rgb, count, prio, deadline);
+	mutex_unlock(&ccp->led_mutex);
+
+	return ret;
+}
+
+static unsigned long ccp_led_stream_period(struct ccp_led_stream *stream)
+{
+	return max(HZ / stream->fps, 1U);
+}
+
+/* queues the work for the next slot, must be called with stream->mutex held */
+static void ccp_led_stream_kick(struct ccp_led_stream *stream)
+{
+	unsigned long due = stream->last + ccp_led_stream_period(stream);
+
+	/* does nothing while it is queued already */
+	queue_delayed_work(system_wq, &stream->work,
+			   time_after(due, jiffies) ? due - jiffies : 0);
+}
+
+/* uploads the newest frame of each channel, fan and sensor commands go first */
+static void ccp_led_stream_work(struct work_struct *work)
+{
+	struct ccp_led_stream *stream = container_of(to_delayed_work(work),
+						     struct ccp_led_stream, work);
+	struct ccp_device *ccp = container_of(stream, struct ccp_device, stream);
+	int count[NUM_LED_CHANNELS];
+	ktime_t deadline;
+	int channel;
+	bool sent = false;
+
+	mutex_lock(&stream->mutex);
+	/* the next frame replaces one not sent by then, the last ones are always sent */
+	deadline = stream->fps ? ktime_add_ms(ktime_get(),
+					      jiffies_to_msecs(ccp_led_stream_period(stream))) : 0;
+	for (channel = 0; channel < NUM_LED_CHANNELS; channel++) {
+		count[channel] = stream->buf[channel].count;
+		if (count[channel])
+			memcpy(stream->buf[channel].front, stream->buf[channel].back,
+			       3 * count[channel]);
+		stream->buf[channel].count = 0;
+	}
+	stream->last = jiffies;
+	mutex_unlock(&stream->mutex);
+
+	for (channel = 0; channel < NUM_LED_CHANNELS; channel++) {
+		if (!count[channel])
+			continue;
+		ccp_led_upload(ccp, channel, stream->buf[channel].front, count[channel],
+			       CCP_PRIO_LOW, deadline);
+		sent = true;
+	}
+
+	/* frames written during the upload wait for the next slot */
+	mutex_lock(&stream->mutex);
+	if (sent && stream->fps &&
+	    (stream->buf[0].count || stream->buf[1].count))
+		ccp_led_stream_kick(stream);
+	mutex_unlock(&stream->mutex);
+}
+
+/* returns false if the stream is off and the frame has to be uploaded right away */
+static bool ccp_led_stream_write(struct ccp_device *ccp, int channel, const u8 *rgb,
+				 int count)
+{
+	struct ccp_led_stream *stream = &ccp->stream;
+
+	mutex_lock(&stream->mutex);
+	if (!stream->fps) {
+		mutex_unlock(&stream->mutex);
+		return false;
+	}
+
+	if (stream->buf[channel].count)
+		stream->dropped++;
+	memcpy(stream->buf[channel].back, rgb, 3 * count);
+	stream->buf[channel].count = count;
+	ccp_led_stream_kick(stream);
+	mutex_unlock(&stream->mutex);
+
+	return true;
+}
+
+static ssize_t led_fps_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct ccp_device *ccp = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(ccp->stream.fps));
+}
+
+static ssize_t led_fps_store(struct device *dev, struct device_attribute *attr,
+			     const char *buf, size_t count)
+{
+	struct ccp_device *ccp = dev_get_drvdata(dev);
+	unsigned int fps;
+	int ret;
+
+	ret = kstrtouint(buf, 10, &fps);
+	if (ret)
+		return ret;
+	if (fps > LED_FPS_MAX)
+		return -EINVAL;
+
+	mutex_lock(&ccp->stream.mutex);
+	ccp->stream.fps = fps;
+	mutex_unlock(&ccp->stream.mutex);
+
+	/* switching off uploads the waiting frames */
+	if (!fps)
+		flush_delayed_work(&ccp->stream.work);
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(led_fps);
+
+/*
+ * Temperature indicator: every SENSOR_CACHE_TIME the leds of the channel are set to the
+ * color of the current temperature. The reading comes from the sensor cache and only
+ * changed leds are uploaded, so a steady temperature costs no usb traffic.
+ */
+static u32 ccp_indicator_color(const struct ccp_led_indicator *ind, long temp)
+{
+	u32 rgb = 0;
+	int frac;
+	int comp;
+	int c0;
+	int c1;
+	int i;
+
+	if (temp <= ind->point_temp[0])
+		return ind->point_rgb[0];
+
+	for (i = 1; i < LED_INDICATOR_POINTS; i++) {
+		if (temp >= ind->point_temp[i])
+			continue;
+		frac = (temp - ind->point_temp[i - 1]) * 256 /
+		       (ind->point_temp[i] - ind->point_temp[i - 1]);
+		for (comp = 16; comp >= 0; comp -= 8) {
+			c0 = (ind->point_rgb[i - 1] >> comp) & 0xff;
+			c1 = (ind->point_rgb[i] >> comp) & 0xff;
+			rgb |= (c0 + (c1 - c0) * frac / 256) << comp;
+		}
+		return rgb;
+	}
+
+	return ind->point_rgb[LED_INDICATOR_POINTS - 1];
+}
+
+static void ccp_indicator_work(struct work_struct *work)
+{
+	struct ccp_device *ccp = container_of(to_delayed_work(work), struct ccp_device,
+					      indicator_work);
+	struct ccp_led_indicator ind;
+	bool active = false;
+	u32 color;
+	long temp;
+	int channel;
+	int i;
+
+	for (channel = 0; channel < NUM_LED_CHANNELS; channel++) {
+		mutex_lock(&ccp->stream.mutex);
+		ind = ccp->indicator[channel];
+		mutex_unlock(&ccp->stream.mutex);
+
+		if (ind.temp < 0)
+			continue;
+		active = true;
+
+		/* the leds keep their color while the sensor fails */
+		if (IS_ERR_OR_NULL(ccp->hwmon_dev) ||
+		    ccp_read(ccp->hwmon_dev, hwmon_temp, hwmon_temp_input, ind.temp, &temp))
+			continue;
+
+		/* the frame is built in led_frame, it is too large for the stack */
+		color = ccp_indicator_color(&ind, temp);
+		mutex_lock(&ccp->led_mutex);
+		for (i = 0; i < ind.count; i++) {
+			ccp->led_frame[3 * i] = color >> 16;
+			ccp->led_frame[3 * i + 1] = color >> 8;
+			ccp->led_frame[3 * i + 2] = color;
+		}
+		ccp_led_send(ccp, channel, ccp->led_frame, ind.count, CCP_PRIO_LOW,
+			     ccp_sensor_deadline());
+		mutex_unlock(&ccp->led_mutex);
+	}
+
+	if (active)
+		schedule_delayed_work(&ccp->indicator_work, SENSOR_CACHE_TIME);
+}
+
+/* "off" or "<temp channel> <leds> <temp> <rrggbb> <temp> <rrggbb> <temp> <rrggbb>" */
+static ssize_t led_indicator_show(struct device *dev, struct device_attribute *attr,
+				  char *buf)
+{
+	struct ccp_device *ccp = dev_get_drvdata(dev);
+	int channel = to_sensor_dev_attr(attr)->index;
+	struct ccp_led_indicator ind;
+
+	mutex_lock(&ccp->stream.mutex);
+	ind = ccp->indicator[channel];
+	mutex_unlock(&ccp->stream.mutex);
+
+	if (ind.temp < 0)
+		return sysfs_emit(buf, "off\n");
+
+	return sysfs_emit(buf, "%d %d %d %06x %d %06x %d %06x\n", ind.temp + 1, ind.count,
+			  ind.point_temp[0], ind.point_rgb[0], ind.point_temp[1],
+			  ind.point_rgb[1], ind.point_temp[2], ind.point_rgb[2]);
+}
+
+static ssize_t led_indicator_store(struct device *dev, struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	struct ccp_device *ccp = dev_get_drvdata(dev);
+	int channel = to_sensor_dev_attr(attr)->index;
+	struct ccp_led_indicator ind = { .temp = -1 };
+	int i;
+
+	if (!sysfs_streq(buf, "off")) {
+		if (sscanf(buf, "%d %d %d %x %d %x %d %x", &ind.temp, &ind.count,
+			   &ind.point_temp[0], &ind.point_rgb[0], &ind.point_temp[1],
+			   &ind.point_rgb[1], &ind.point_temp[2], &ind.point_rgb[2]) != 8)
+			return -EINVAL;
+
+		if (ind.temp < 1 || ind.temp > NUM_TEMP_SENSORS + NUM_VIRT_CHANNELS ||
+		    ind.count < 1 || ind.count > LED_MAX)
+			return -EINVAL;
+		for (i = 0; i < LED_INDICATOR_POINTS; i++) {
+			if (ind.point_rgb[i] > 0xffffff)
+				return -EINVAL;
+			if (i && ind.point_temp[i] <= ind.point_temp[i - 1])
+				return -EINVAL;
+		}
+		ind.temp--;
+		if (!ccp_temp_usable(ccp, ind.temp))
+			return -ENODATA;
+	}
+
+	mutex_lock(&ccp->stream.mutex);
+	ccp->indicator[channel] = ind;
+	mutex_unlock(&ccp->stream.mutex);
+
+	if (ind.temp >= 0)
+		mod_delayed_work(system_wq, &ccp->indicator_work, 0);
+
+	return count;
+}
+
+static SENSOR_DEVICE_ATTR_RW(led1_indicator, led_indicator, 0);
+static SENSOR_DEVICE_ATTR_RW(led2_indicator, led_indicator, 1);
+
+static bool ccp_indicator_active(struct ccp_device *ccp, int channel)
+{
+	bool active;
+
+	mutex_lock(&ccp->stream.mutex);
+	active = ccp->indicator[channel].temp >= 0;
+	mutex_unlock(&ccp->stream.mutex);
+
+	return active;
+}
+
+static void ccp_led_stream_init(struct ccp_device *ccp)
+{
+	int channel;
+
+	mutex_init(&ccp->stream.mutex);
+	INIT_DELAYED_WORK(&ccp->stream.work, ccp_led_stream_work);
+	INIT_DELAYED_WORK(&ccp->indicator_work, ccp_indicator_work);
+	for (channel = 0; channel < NUM_LED_CHANNELS; channel++)
+		ccp->indicator[channel].temp = -1;
+}
+
+/* led[1-2]_rgb: colors as red, green, blue bytes for the first leds of the channel */
+static ssize_t led_rgb_read(struct file *file, struct kobject *kobj,
+			    const struct bin_attribute *attr, char *buf, loff_t off, size_t count)
+{
+	struct ccp_device *ccp = dev_get_drvdata(kobj_to_dev(kobj));
+	const struct ccp_led_channel *led = &ccp->leds[(uintptr_t)attr->private];
+	ssize_t ret;
+	int comp;
+	int i;
+
+	mutex_lock(&ccp->led_mutex);
+	for (i = 0; i < led->count; i++)
+		for (comp = 0; comp < 3; comp++)
+			ccp->led_frame[3 * i + comp] = led->shadow[comp][i];
+	ret = memory_read_from_buffer(buf, count, &off, ccp->led_frame, 3 * led->count);
+	mutex_unlock(&ccp->led_mutex);
+
+	return ret;
+}
+
+static ssize_t led_rgb_write(struct file *file, struct kobject *kobj,
+			     const struct bin_attribute *attr, char *buf, loff_t off, size_t count)
+{
+	struct ccp_device *ccp = dev_get_drvdata(kobj_to_dev(kobj));
+	int ret;
+
+	/* one write is one frame of the effect */
+	if (off || !count || count % 3)
+		return -EINVAL;
+	if (ccp_indicator_active(ccp, (uintptr_t)attr->private))
+		return -EBUSY;
+
+	if (ccp_led_stream_write(ccp, (uintptr_t)attr->private, (const u8 *)buf, count / 3))
+		return count;
+
+	ret = ccp_led_upload(ccp, (uintptr_t)attr->private, (const u8 *)buf, count / 3,
+			     CCP_PRIO_NORMAL, 0);
+
+	return ret ? ret : count;
+}
+
+static const struct bin_attribute bin_attr_led1_rgb = {
+	.attr = { .name = "led1_rgb", .mode = 0644 },
+	.size = 3 * LED_MAX,
+	.private = (void *)0,
+	.read = led_rgb_read,
+	.write = led_rgb_write,
+};
+
+static const struct bin_attribute bin_attr_led2_rgb = {
+	.attr = { .name = "led2_rgb", .mode = 0644 },
+	.size = 3 * LED_MAX,
+	.private = (void *)1,
+	.read = led_rgb_read,
+	.write = led_rgb_write,
+};
+
+static const struct bin_attribute *const ccp_led_attrs[] = {
+	&bin_attr_led1_rgb,
+	&bin_attr_led2_rgb,
+	NULL
+};
+
+static struct attribute *ccp_led_stream_attrs[] = {
+	&dev_attr_led_fps.attr,
+	&sensor_dev_attr_led1_indicator.dev_attr.attr,
+	&sensor_dev_attr_led2_indicator.dev_attr.attr,
+	NULL
+};
+
+/* the indicator needs temperature sensors */
+static umode_t ccp_led_is_visible(struct kobject *kobj, struct attribute *attr, int n)
+{
+	struct ccp_device *ccp = dev_get_drvdata(kobj_to_dev(kobj));
+
+	if (attr != &dev_attr_led_fps.attr && !ccp->info->hwmon_name)
+		return 0;
+
+	return attr->mode;
+}
+
+static const struct attribute_group ccp_led_group = {
+	.attrs = ccp_led_stream_attrs,
+	.bin_attrs = ccp_led_attrs,
+	.is_visible = ccp_led_is_visible,
+};
+
+/* read fan connection status and set labels */
+static int get_fan_cnct(struct ccp_device *ccp)
+{
+	int channel;
+	int mode;
+	int ret;
+
+	ret = send_usb_cmd(ccp, CTL_GET_FAN_CNCT, 0, 0, 0);
+	if (ret)
+		return ret;
+
+	for (channel = 0; channel < NUM_FANS; channel++) {
+		mode = ccp->buffer[channel + 1];
+		if (mode == 0)
+			continue;
+
+		set_bit(channel, ccp->fan_cnct);
+		ccp->target[channel] = -ENODATA;
+
+		switch (mode) {
+		case 1:
+			scnprintf(ccp->fan_label[channel], LABEL_LENGTH,
+				  "fan%d 3pin", channel + 1);
+			break;
+		case 2:
+			scnprintf(ccp->fan_label[channel], LABEL_LENGTH,
+				  "fan%d 4pin", channel + 1);
+			break;
+		default:
+			scnprintf(ccp->fan_label[channel], LABEL_LENGTH,
+				  "fan%d other", channel + 1);
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/* read temp sensor connection status */
+static int get_temp_cnct(struct ccp_device *ccp)
+{
+	int channel;
+	int mode;
+	int ret;
+
+	ret = send_usb_cmd(ccp, CTL_GET_TMP_CNCT, 0, 0, 0);
+	if (ret)
+		return ret;
+
+	for (channel = 0; channel < NUM_TEMP_SENSORS; channel++) {
+		mode = ccp->buffer[channel + 1];
+		if (mode == 0)
+			continue;
+
+		set_bit(channel, ccp->temp_cnct);
+	}
+
+	return 0;
+}
+
+/* read firmware version */
+static int get_fw_version(struct ccp_device *ccp)
+{
+	int ret;
+
+	ret = send_usb_cmd(ccp, CTL_GET_FW_VER, 0, 0, 0);
+	if (ret) {
+		hid_notice(ccp->hdev, "Failed to read firmware version.\n");
+		return ret;
+	}
+	ccp->firmware_ver[0] = ccp->buffer[1];
+	ccp->firmware_ver[1] = ccp->buffer[2];
+	ccp->firmware_ver[2] = ccp->buffer[3];
+
+	return 0;
+}
+
+/* read bootloader version */
+static int get_bl_version(struct ccp_device *ccp)
+{
+	int ret;
+
+	ret = send_usb_cmd(ccp, CTL_GET_BL_VER, 0, 0, 0);
+	if (ret) {
+		hid_notice(ccp->hdev, "Failed to read bootloader version.\n");
+		return ret;
+	}
+	ccp->bootloader_ver[0] = ccp->buffer[1];
+	ccp->bootloader_ver[1] = ccp->buffer[2];
+
+	return 0;
+}
+
+/* readings of the perf pmu and the history, in the order of the pmu "sensor" field */
+static const enum ccp_sensor_id ccp_input_sensors[] = {
+	CCP_TEMP_INPUT, CCP_FAN_INPUT, CCP_IN_INPUT,
+};
+
+#ifdef CONFIG_PERF_EVENTS
+/*
+ * perf pmu "corsaircproN" with one event per temp, fan and in channel. Counts are the
+ * current reading, scaled like the hwmon attributes. perf reads events from atomic
+ * context, so they return the cached value and a work item refreshes the cache while
+ * events are running. Sampling events fire every sample_period ns.
+ */
+#define CCP_PMU_MIN_PERIOD	(NSEC_PER_SEC / 100)
+
+/*
+ * perf keeps calling open events after the device is removed, so the pmu is allocated
+ * on its own. Remove clears ccp under lock, the callbacks leave the device alone after
+ * it. perf reads the pmu even while freeing the last event, so a pmu that had events
+ * is only freed on module exit, when no event can be left.
+ */
+struct ccp_pmu {
+	struct pmu pmu;
+	char name[16];
+	int id;
+	raw_spinlock_t lock;		/* protects ccp */
+	struct ccp_device *ccp;		/* NULL once the device is removed */
+	bool used;			/* an event was opened */
+	atomic_t active;		/* started events, they keep the cache fresh */
+	struct list_head node;		/* in ccp_pmu_orphans after remove */
+};
+
+static DEFINE_IDA(ccp_pmu_ida);
+static LIST_HEAD(ccp_pmu_orphans);
+static DEFINE_MUTEX(ccp_pmu_orphans_mutex);
+
+PMU_FORMAT_ATTR(channel, "config:0-7");
+PMU_FORMAT_ATTR(sensor, "config:8-15");
+
+static struct attribute *ccp_pmu_format_attrs[] = {
+	&format_attr_channel.attr,
+	&format_attr_sensor.attr,
+	NULL
+};
+
+static const struct attribute_group ccp_pmu_format_group = {
+	.name = "format",
+	.attrs = ccp_pmu_format_attrs,
+};
+
+#define CCP_PMU_EVENT(_name, _sensor, _channel, _scale_str, _unit_str)			\
+	PMU_EVENT_ATTR_STRING(_name, ccp_pmu_##_name,					\
+			      "sensor=" #_sensor ",channel=" #_channel);		\
+	PMU_EVENT_ATTR_STRING(_name.scale, ccp_pmu_##_name##_scale, _scale_str);	\
+	PMU_EVENT_ATTR_STRING(_name.unit, ccp_pmu_##_name##_unit, _unit_str)
+
+#define CCP_PMU_EVENT_PTRS(_name)		\
+	&ccp_pmu_##_name.attr.attr,		\
+	&ccp_pmu_##_name##_scale.attr.attr,	\
+	&ccp_pmu_##_name##_unit.attr.attr
+
+CCP_PMU_EVENT(temp1, 0, 0, "0.001", "C");
+CCP_PMU_EVENT(temp2, 0, 1, "0.001", "C");
+CCP_PMU_EVENT(temp3, 0, 2, "0.001", "C");
+CCP_PMU_EVENT(temp4, 0, 3, "0.001", "C");
+CCP_PMU_EVENT(fan1, 1, 0, "1", "RPM");
+CCP_PMU_EVENT(fan2, 1, 1, "1", "RPM");
+CCP_PMU_EVENT(fan3, 1, 2, "1", "RPM");
+CCP_PMU_EVENT(fan4, 1, 3, "1", "RPM");
+CCP_PMU_EVENT(fan5, 1, 4, "1", "RPM");
+CCP_PMU_EVENT(fan6, 1, 5, "1", "RPM");
+CCP_PMU_EVENT(in0, 2, 0, "0.001", "V");
+CCP_PMU_EVENT(in1, 2, 1, "0.001", "V");
+CCP_PMU_EVENT(in2, 2, 2, "0.001", "V");
+
+static struct attribute *ccp_pmu_event_attrs[] = {
+	CCP_PMU_EVENT_PTRS(temp1),
+	CCP_PMU_EVENT_PTRS(temp2),
+	CCP_PMU_EVENT_PTRS(temp3),
+	CCP_PMU_EVENT_PTRS(temp4),
+	CCP_PMU_EVENT_PTRS(fan1),
+	CCP_PMU_EVENT_PTRS(fan2),
+	CCP_PMU_EVENT_PTRS(fan3),
+	CCP_PMU_EVENT_PTRS(fan4),
+	CCP_PMU_EVENT_PTRS(fan5),
+	CCP_PMU_EVENT_PTRS(fan6),
+	CCP_PMU_EVENT_PTRS(in0),
+	CCP_PMU_EVENT_PTRS(in1),
+	CCP_PMU_EVENT_PTRS(in2),
+	NULL
+};
+
+static const struct attribute_group ccp_pmu_events_group = {
+	.name = "events",
+	.attrs = ccp_pmu_event_attrs,
+};
+
+/* the readings are not per cpu, perf opens system wide events on cpu 0 only */
+static ssize_t cpumask_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return cpumap_print_to_pagebuf(true, buf, cpumask_of(0));
+}
+
+static DEVICE_ATTR_RO(cpumask);
+
+static struct attribute *ccp_pmu_cpumask_attrs[] = {
+	&dev_attr_cpumask.attr,
+	NULL
+};
+
+static const struct attribute_group ccp_pmu_cpumask_group = {
+	.attrs = ccp_pmu_cpumask_attrs,
+};
+
+static const struct attribute_group *ccp_pmu_attr_groups[] = {
+	&ccp_pmu_format_group,
+	&ccp_pmu_events_group,
+	&ccp_pmu_cpumask_group,
+	NULL
+};
+
+static struct ccp_pmu *to_ccp_pmu(struct pmu *pmu)
+{
+	return container_of(pmu, struct ccp_pmu, pmu);
+}
+
+static void ccp_pmu_work(struct work_struct *work)
+{
+	struct ccp_device *ccp = container_of(to_delayed_work(work), struct ccp_device, pmu_work);
+
+	if (!atomic_read(&ccp->pmu->active))
+		return;
+
+	mutex_lock(&ccp->mutex);
+	ccp_update_sensors(ccp);
+	mutex_unlock(&ccp->mutex);
+
+	schedule_delayed_work(&ccp->pmu_work, SENSOR_CACHE_TIME);
+}
+
+static void ccp_pmu_read(struct perf_event *event)
+{
+	struct ccp_pmu *pmu = to_ccp_pmu(event->pmu);
+	const struct ccp_sensor_desc *desc = &ccp_sensors[event->hw.config];
+	struct ccp_device *ccp;
+	unsigned long flags;
+	int value = -ENODEV;
+
+	raw_spin_lock_irqsave(&pmu->lock, flags);
+	ccp = pmu->ccp;
+	if (ccp && !test_bit(event->hw.idx, &ccp->disabled[event->hw.config]))
+		value = READ_ONCE(ccp->sensors[event->hw.config][event->hw.idx].value);
+	raw_spin_unlock_irqrestore(&pmu->lock, flags);
+
+	/* errors, removed devices and channels disabled meanwhile keep the last reading */
+	if (value >= 0)
+		local64_set(&event->count, DIV_ROUND_CLOSEST(value * desc->mul, desc->div));
+}
+
+static enum hrtimer_restart ccp_pmu_hrtimer(struct hrtimer *hrtimer)
+{
+	struct perf_event *event = container_of(hrtimer, struct perf_event, hw.hrtimer);
+	struct perf_sample_data data;
+	struct pt_regs *regs = get_irq_regs();
+
+	ccp_pmu_read(event);
+
+	/* the period of a sample is the reading, "perf script -F period" prints it */
+	perf_sample_data_init(&data, 0, local64_read(&event->count));
+	if (regs && perf_event_overflow(event, &data, regs))
+		return HRTIMER_NORESTART;
+
+	hrtimer_forward_now(hrtimer, ns_to_ktime(event->hw.sample_period));
+	return HRTIMER_RESTART;
+}
+
+static int ccp_pmu_event_init(struct perf_event *event)
+{
+	struct ccp_pmu *pmu = to_ccp_pmu(event->pmu);
+	unsigned int sensor = (event->attr.config >> 8) & 0xff;
+	unsigned int channel = event->attr.config & 0xff;
+	const struct ccp_sensor_desc *desc;
+	struct ccp_device *ccp;
+	int ret = 0;
+
+	if (event->attr.type != event->pmu->type)
+		return -ENOENT;
+	if (event->cpu < 0 || event->attach_state & PERF_ATTACH_TASK)
+		return -EINVAL;
+	if (is_sampling_event(event) && event->attr.freq)
+		return -EINVAL;
+
+	if (event->attr.config & ~0xffffULL || sensor >= ARRAY_SIZE(ccp_input_sensors))
+		return -EINVAL;
+	desc = &ccp_sensors[ccp_input_sensors[sensor]];
+	if (channel >= desc->channels)
+		return -ENODEV;
+
+	raw_spin_lock_irq(&pmu->lock);
+	ccp = pmu->ccp;
+	if (!ccp || !ccp_connected(ccp, desc, channel))
+		ret = -ENODEV;
+	/* the sweeps leave it out, the count would never change */
+	else if (test_bit(channel, &ccp->disabled[ccp_input_sensors[sensor]]))
+		ret = -ENODATA;
+	else
+		pmu->used = true;
+	raw_spin_unlock_irq(&pmu->lock);
+	if (ret)
+		return ret;
+
+	event->hw.config = ccp_input_sensors[sensor];
+	event->hw.idx = channel;
+
+	if (is_sampling_event(event)) {
+		event->hw.sample_period = max_t(u64, event->attr.sample_period,
+						CCP_PMU_MIN_PERIOD);
+		hrtimer_setup(&event->hw.hrtimer, ccp_pmu_hrtimer, CLOCK_MONOTONIC,
+			      HRTIMER_MODE_REL_HARD);
+	}
+
+	return 0;
+}
+
+static void ccp_pmu_start(struct perf_event *event, int flags)
+{
+	struct ccp_pmu *pmu = to_ccp_pmu(event->pmu);
+	unsigned long irqflags;
+
+	/* the first event starts the refresh, queueing is safe from atomic context */
+	raw_spin_lock_irqsave(&pmu->lock, irqflags);
+	if (atomic_inc_return(&pmu->active) == 1 && pmu->ccp)
+		mod_delayed_work(system_wq, &pmu->ccp->pmu_work, 0);
+	raw_spin_unlock_irqrestore(&pmu->lock, irqflags);
+
+	event->hw.state = 0;
+	ccp_pmu_read(event);
+
+	if (is_sampling_event(event))
+		hrtimer_start(&event->hw.hrtimer, ns_to_ktime(event->hw.sample_period),
+			      HRTIMER_MODE_REL_PINNED_HARD);
+}
+
+static void ccp_pmu_stop(struct perf_event *event, int flags)
+{
+	struct ccp_pmu *pmu = to_ccp_pmu(event->pmu);
+
+	if (event->hw.state & PERF_HES_STOPPED)
+		return;
+
+	if (is_sampling_event(event))
+		hrtimer_cancel(&event->hw.hrtimer);
+	if (flags & PERF_EF_UPDATE)
+		ccp_pmu_read(event);
+
+	atomic_dec(&pmu->active);
+	event->hw.state = PERF_HES_STOPPED | PERF_HES_UPTODATE;
+}
+
+static int ccp_pmu_add(struct perf_event *event, int flags)
+{
+	event->hw.state = PERF_HES_STOPPED | PERF_HES_UPTODATE;
+	if (flags & PERF_EF_START)
+		ccp_pmu_start(event, flags);
+
+	return 0;
+}
+
+static void ccp_pmu_del(struct perf_event *event, int flags)
+{
+	ccp_pmu_stop(event, PERF_EF_UPDATE);
+}
+
+static void ccp_pmu_register(struct ccp_device *ccp)
+{
+	struct ccp_pmu *pmu;
+	int ret;
+
+	INIT_DELAYED_WORK(&ccp->pmu_work, ccp_pmu_work);
+
+	pmu = kzalloc(sizeof(*pmu), GFP_KERNEL);
+	if (!pmu)
+		return;
+
+	pmu->id = ida_alloc(&ccp_pmu_ida, GFP_KERNEL);
+	if (pmu->id < 0) {
+		kfree(pmu);
+		return;
+	}
+
+	scnprintf(pmu->name, sizeof(pmu->name), "corsaircpro%d", pmu->id);
+	raw_spin_lock_init(&pmu->lock);
+	pmu->ccp = ccp;
+	pmu->pmu = (struct pmu) {
+		.module = THIS_MODULE,
+		.attr_groups = ccp_pmu_attr_groups,
+		.task_ctx_nr = perf_invalid_context,
+		.capabilities = PERF_PMU_CAP_NO_EXCLUDE,
+		.event_init = ccp_pmu_event_init,
+		.add = ccp_pmu_add,
+		.del = ccp_pmu_del,
+		.start = ccp_pmu_start,
+		.stop = ccp_pmu_stop,
+		.read = ccp_pmu_read,
+	};
+
+	/* perf is optional, the hwmon device works without it */
+	ret = perf_pmu_register(&pmu->pmu, pmu->name, -1);
+	if (ret) {
+		hid_notice(ccp->hdev, "Failed to register perf pmu: %d\n", ret);
+		ida_free(&ccp_pmu_ida, pmu->id);
+		kfree(pmu);
+		return;
+	}
+
+	ccp->pmu = pmu;
+}
+
+static void ccp_pmu_unregister(struct ccp_device *ccp)
+{
+	struct ccp_pmu *pmu = ccp->pmu;
+
+	if (!pmu)
+		return;
+
+	/* no callback touches ccp after it, start no longer queues the work */
+	raw_spin_lock_irq(&pmu->lock);
+	pmu->ccp = NULL;
+	raw_spin_unlock_irq(&pmu->lock);
+	cancel_delayed_work_sync(&ccp->pmu_work);
+
+	perf_pmu_unregister(&pmu->pmu);
+	ida_free(&ccp_pmu_ida, pmu->id);
+	ccp->pmu = NULL;
+
+	if (!pmu->used) {
+		kfree(pmu);
+		return;
+	}
+
+	mutex_lock(&ccp_pmu_orphans_mutex);
+	list_add(&pmu->node, &ccp_pmu_orphans);
+	mutex_unlock(&ccp_pmu_orphans_mutex);
+}
+
+/* the events of removed devices hold a reference of the module, none is left */
+static void ccp_pmu_exit(void)
+{
+	struct ccp_pmu *pmu, *tmp;
+
+	list_for_each_entry_safe(pmu, tmp, &ccp_pmu_orphans, node)
+		kfree(pmu);
+}
+#else
+static void ccp_pmu_register(struct ccp_device *ccp) {}
+static void ccp_pmu_unregister(struct ccp_device *ccp) {}
+static void ccp_pmu_exit(void) {}
+#endif
+
+/*
+ * Once per second the inputs of ccp_input_sensors are sampled into a ring of
+ * history_size bytes. A block starts with its used length, the time in ns and the mask of
+ * valid channels, followed by their values. Every further sample stores the changed
+ * bits of the mask, the ms since the previous sample and the difference of every valid
+ * channel, all as zigzag varints. Readings change slowly, so a sample takes about
+ * 16 bytes instead of 60 and 1 MiB holds more than 18 hours.
+ */
+static int ccp_hist_put(u8 *p, u32 v)
+{
+	int n = 0;
+
+	while (v >= 0x80) {
+		p[n++] = v | 0x80;
+		v >>= 7;
+	}
+	p[n++] = v;
+
+	return n;
+}
+
+/* returns the bytes taken or 0 if the varint is truncated */
+static int ccp_hist_get(const u8 *p, const u8 *end, u32 *v)
 {
-	int ret;
+	int shift = 0;
+	int n = 0;
 
-	val = clamp_val(val, 0, 0xFFFF);
-	ccp->target[channel] = val;
+	*v = 0;
+	while (p + n < end && shift < 32) {
+		*v |= (u32)(p[n] & 0x7f) << shift;
+		if (!(p[n++] & 0x80))
+			return n;
+		shift += 7;
+	}
 
-	mutex_lock(&ccp->mutex);
-	ret = send_usb_cmd(ccp, CTL_SET_FAN_TARGET, channel, val >> 8, val);
+	return 0;
+}
 
-	mutex_unlock(&ccp->mutex);
-	return ret;
+static u32 ccp_hist_zigzag(int v)
+{
+	return ((u32)v << 1) ^ (u32)(v >> 31);
 }
 
-static int ccp_read_string(struct device *dev, enum hwmon_sensor_types type,
-			   u32 attr, int channel, const char **str)
+static int ccp_hist_unzigzag(u32 v)
 {
-	struct ccp_device *ccp = dev_get_drvdata(dev);
+	return (v >> 1) ^ -(int)(v & 1);
+}
 
-	switch (type) {
-	case hwmon_fan:
-		switch (attr) {
-		case hwmon_fan_label:
-			*str = ccp->fan_label[channel];
-			return 0;
-		default:
-			break;
+/*
+ * current readings, a channel is valid if it was read during the last two sweeps. The
+ * sweep leaves out the channels the pmu or a reader refreshed already.
+ */
+static u32 ccp_hist_read(struct ccp_device *ccp, int *values)
+{
+	const struct ccp_sensor_desc *desc;
+	struct ccp_sensor *sensor;
+	u32 mask = 0;
+	int channel;
+	int n = 0;
+	int i;
+
+	mutex_lock(&ccp->mutex);
+	ccp_update_sensors(ccp);
+	for (i = 0; i < ARRAY_SIZE(ccp_input_sensors); i++) {
+		desc = &ccp_sensors[ccp_input_sensors[i]];
+		for (channel = 0; channel < desc->channels; channel++, n++) {
+			sensor = &ccp->sensors[ccp_input_sensors[i]][channel];
+			/* errors are cached as negative values, like for the pmu */
+			if (!sensor->valid || sensor->value < 0 ||
+			    time_after(jiffies, sensor->updated + 2 * SENSOR_CACHE_TIME))
+				continue;
+			mask |= BIT(n);
+			values[n] = DIV_ROUND_CLOSEST(sensor->value * desc->mul, desc->div);
 		}
-		break;
-	default:
-		break;
 	}
+	mutex_unlock(&ccp->mutex);
 
-	return -EOPNOTSUPP;
+	return mask;
 }
 
-static int ccp_read(struct device *dev, enum hwmon_sensor_types type,
-		    u32 attr, int channel, long *val)
+static void ccp_history_store(struct ccp_history *hist, ktime_t now, u32 mask,
+			      const int *values)
 {
-	struct ccp_device *ccp = dev_get_drvdata(dev);
-	int ret;
+	u8 rec[HIST_RECORD_MAX];
+	u8 *block = hist->buf + hist->head * HIST_BLOCK_SIZE;
+	u16 used = hist->count ? get_unaligned_le16(block) : HIST_BLOCK_SIZE;
+	int len = 0;
+	int base;
+	int dt;
+	int i;
 
-	switch (type) {
-	case hwmon_temp:
-		switch (attr) {
-		case hwmon_temp_input:
-			ret = get_data(ccp, CTL_GET_TMP, channel, true);
-			if (ret < 0)
-				return ret;
-			*val = ret * 10;
-			return 0;
-		default:
-			break;
-		}
-		break;
-	case hwmon_fan:
-		switch (attr) {
-		case hwmon_fan_input:
-			ret = get_data(ccp, CTL_GET_FAN_RPM, channel, true);
-			if (ret < 0)
-				return ret;
-			*val = ret;
-			return 0;
-		case hwmon_fan_target:
-			/* how to read target values from the device is unknown */
-			/* driver returns last set value or 0			*/
-			if (ccp->target[channel] < 0)
-				return -ENODATA;
-			*val = ccp->target[channel];
-			return 0;
-		default:
-			break;
-		}
-		break;
-	case hwmon_pwm:
-		switch (attr) {
-		case hwmon_pwm_input:
-			ret = get_data(ccp, CTL_GET_FAN_PWM, channel, false);
-			if (ret < 0)
-				return ret;
-			*val = DIV_ROUND_CLOSEST(ret * 255, 100);
-			return 0;
-		default:
-			break;
-		}
-		break;
-	case hwmon_in:
-		switch (attr) {
-		case hwmon_in_input:
-			ret = get_data(ccp, CTL_GET_VOLT, channel, true);
-			if (ret < 0)
-				return ret;
-			*val = ret;
-			return 0;
-		default:
-			break;
+	lockdep_assert_held(&hist->mutex);
+
+	dt = ktime_ms_delta(now, hist->last_time);
+	for (i = 0; i < HIST_CHANNELS; i++)
+		if (mask & BIT(i))
+			len += 5;
+
+	if (used + 10 + len > HIST_BLOCK_SIZE) {
+		/* new block with a full sample, it replaces the oldest one when full */
+		hist->head = (hist->head + 1) % hist->nblocks;
+		hist->count = min(hist->count + 1, hist->nblocks);
+		block = hist->buf + hist->head * HIST_BLOCK_SIZE;
+
+		len = 2;
+		put_unaligned_le64(ktime_to_ns(now), rec + len);
+		len += 8;
+		len += ccp_hist_put(rec + len, mask);
+		for (i = 0; i < HIST_CHANNELS; i++)
+			if (mask & BIT(i))
+				len += ccp_hist_put(rec + len, ccp_hist_zigzag(values[i]));
+		used = 0;
+		hist->last_time = now;
+	} else {
+		len = 0;
+		len += ccp_hist_put(rec + len, mask ^ hist->last_mask);
+		len += ccp_hist_put(rec + len, dt);
+		for (i = 0; i < HIST_CHANNELS; i++) {
+			if (!(mask & BIT(i)))
+				continue;
+			/* channels becoming valid start from 0 */
+			base = hist->last_mask & BIT(i) ? hist->last[i] : 0;
+			len += ccp_hist_put(rec + len, ccp_hist_zigzag(values[i] - base));
 		}
-		break;
-	default:
-		break;
+		/* decoded times add up the ms, so they do not drift away */
+		hist->last_time = ktime_add_ms(hist->last_time, dt);
 	}
 
-	return -EOPNOTSUPP;
-};
+	memcpy(block + used, rec, len);
+	put_unaligned_le16(used + len, block);
+	for (i = 0; i < HIST_CHANNELS; i++)
+		if (mask & BIT(i))
+			hist->last[i] = values[i];
+	hist->last_mask = mask;
+	hist->samples++;
+}
 
-static int ccp_write(struct device *dev, enum hwmon_sensor_types type,
-		     u32 attr, int channel, long val)
+static void ccp_history_work(struct work_struct *work)
 {
-	struct ccp_device *ccp = dev_get_drvdata(dev);
+	struct ccp_history *hist = container_of(to_delayed_work(work), struct ccp_history,
+						work);
+	struct ccp_device *ccp = container_of(hist, struct ccp_device, history);
+	int values[HIST_CHANNELS];
+	u32 mask;
 
-	switch (type) {
-	case hwmon_pwm:
-		switch (attr) {
-		case hwmon_pwm_input:
-			return set_pwm(ccp, channel, val);
-		default:
-			break;
-		}
-		break;
-	case hwmon_fan:
-		switch (attr) {
-		case hwmon_fan_target:
-			return set_target(ccp, channel, val);
-		default:
-			break;
-		}
-		break;
-	default:
-		break;
-	}
+	mask = ccp_hist_read(ccp, values);
 
-	return -EOPNOTSUPP;
-};
+	mutex_lock(&hist->mutex);
+	if (hist->buf) {
+		ccp_history_store(hist, ktime_get(), mask, values);
+		schedule_delayed_work(&hist->work, SENSOR_CACHE_TIME);
+	}
+	mutex_unlock(&hist->mutex);
+}
 
-static umode_t ccp_is_visible(const void *data, enum hwmon_sensor_types type,
-			      u32 attr, int channel)
+/* one line per sample: "<time ns>" and the readings of ccp_input_sensors, "-" if invalid */
+static void ccp_history_show_block(struct seq_file *seqf, const u8 *block)
 {
-	const struct ccp_device *ccp = data;
+	const u8 *end = block + get_unaligned_le16(block);
+	const u8 *p = block + 2 + 8;
+	int values[HIST_CHANNELS];
+	ktime_t time;
+	u32 last_mask;
+	u32 mask;
+	u32 v;
+	int n;
+	int i;
 
-	switch (type) {
-	case hwmon_temp:
-		if (!test_bit(channel, ccp->temp_cnct))
-			break;
+	if (end < p || end > block + HIST_BLOCK_SIZE)
+		return;
 
-		switch (attr) {
-		case hwmon_temp_input:
-			return 0444;
-		case hwmon_temp_label:
-			return 0444;
-		default:
-			break;
-		}
-		break;
-	case hwmon_fan:
-		if (!test_bit(channel, ccp->fan_cnct))
-			break;
+	time = get_unaligned_le64(block + 2);
+	n = ccp_hist_get(p, end, &mask);
+	for (p += n, i = 0; n && i < HIST_CHANNELS; i++) {
+		if (!(mask & BIT(i)))
+			continue;
+		n = ccp_hist_get(p, end, &v);
+		p += n;
+		values[i] = ccp_hist_unzigzag(v);
+	}
 
-		switch (attr) {
-		case hwmon_fan_input:
-			return 0444;
-		case hwmon_fan_label:
-			return 0444;
-		case hwmon_fan_target:
-			return 0644;
-		default:
-			break;
+	while (n) {
+		seq_printf(seqf, "%lld", ktime_to_ns(time));
+		for (i = 0; i < HIST_CHANNELS; i++) {
+			if (mask & BIT(i))
+				seq_printf(seqf, " %d", values[i]);
+			else
+				seq_puts(seqf, " -");
 		}
-		break;
-	case hwmon_pwm:
-		if (!test_bit(channel, ccp->fan_cnct))
-			break;
+		seq_putc(seqf, '\n');
 
-		switch (attr) {
-		case hwmon_pwm_input:
-			return 0644;
-		default:
+		if (p == end)
 			break;
+		n = ccp_hist_get(p, end, &v);
+		p += n;
+		last_mask = mask;
+		mask ^= v;
+		if (n) {
+			n = ccp_hist_get(p, end, &v);
+			p += n;
+			time = ktime_add_ms(time, v);
 		}
-		break;
-	case hwmon_in:
-		switch (attr) {
-		case hwmon_in_input:
-			return 0444;
-		default:
-			break;
+		for (i = 0; n && i < HIST_CHANNELS; i++) {
+			if (!(mask & BIT(i)))
+				continue;
+			n = ccp_hist_get(p, end, &v);
+			p += n;
+			values[i] = ccp_hist_unzigzag(v) +
+				    (last_mask & BIT(i) ? values[i] : 0);
 		}
-		break;
-	default:
-		break;
 	}
+}
 
-	return 0;
-};
-
-static const struct hwmon_ops ccp_hwmon_ops = {
-	.is_visible = ccp_is_visible,
-	.read = ccp_read,
-	.read_string = ccp_read_string,
-	.write = ccp_write,
-};
+/* blocks are shown from the oldest to the newest, the position is the block number */
+static void *history_start(struct seq_file *seqf, loff_t *pos)
+{
+	struct ccp_history *hist = seqf->private;
 
-static const struct hwmon_channel_info * const ccp_info[] = {
-	HWMON_CHANNEL_INFO(chip,
-			   HWMON_C_REGISTER_TZ),
-	HWMON_CHANNEL_INFO(temp,
-			   HWMON_T_INPUT,
-			   HWMON_T_INPUT,
-			   HWMON_T_INPUT,
-			   HWMON_T_INPUT
-			   ),
-	HWMON_CHANNEL_INFO(fan,
-			   HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_TARGET,
-			   HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_TARGET,
-			   HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_TARGET,
-			   HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_TARGET,
-			   HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_TARGET,
-			   HWMON_F_INPUT | HWMON_F_LABEL | HWMON_F_TARGET
-			   ),
-	HWMON_CHANNEL_INFO(pwm,
-			   HWMON_PWM_INPUT,
-			   HWMON_PWM_INPUT,
-			   HWMON_PWM_INPUT,
-			   HWMON_PWM_INPUT,
-			   HWMON_PWM_INPUT,
-			   HWMON_PWM_INPUT
-			   ),
-	HWMON_CHANNEL_INFO(in,
-			   HWMON_I_INPUT,
-			   HWMON_I_INPUT,
-			   HWMON_I_INPUT
-			   ),
-	NULL
-};
+	mutex_lock(&hist->mutex);
+	if (*pos >= hist->count)
+		return NULL;
 
-static const struct hwmon_chip_info ccp_chip_info = {
-	.ops = &ccp_hwmon_ops,
-	.info = ccp_info,
-};
+	return hist->buf + (hist->head - hist->count + 1 + *pos + hist->nblocks) %
+			   hist->nblocks * HIST_BLOCK_SIZE;
+}
 
-/* read fan connection status and set labels */
-static int get_fan_cnct(struct ccp_device *ccp)
+static void *history_next(struct seq_file *seqf, void *v, loff_t *pos)
 {
-	int channel;
-	int mode;
-	int ret;
-
-	ret = send_usb_cmd(ccp, CTL_GET_FAN_CNCT, 0, 0, 0);
-	if (ret)
-		return ret;
+	struct ccp_history *hist = seqf->private;
 
-	for (channel = 0; channel < NUM_FANS; channel++) {
-		mode = ccp->buffer[channel + 1];
-		if (mode == 0)
-			continue;
+	++*pos;
+	if (*pos >= hist->count)
+		return NULL;
 
-		set_bit(channel, ccp->fan_cnct);
-		ccp->target[channel] = -ENODATA;
+	return hist->buf + (hist->head - hist->count + 1 + *pos + hist->nblocks) %
+			   hist->nblocks * HIST_BLOCK_SIZE;
+}
 
-		switch (mode) {
-		case 1:
-			scnprintf(ccp->fan_label[channel], LABEL_LENGTH,
-				  "fan%d 3pin", channel + 1);
-			break;
-		case 2:
-			scnprintf(ccp->fan_label[channel], LABEL_LENGTH,
-				  "fan%d 4pin", channel + 1);
-			break;
-		default:
-			scnprintf(ccp->fan_label[channel], LABEL_LENGTH,
-				  "fan%d other", channel + 1);
-			break;
-		}
-	}
+static void history_stop(struct seq_file *seqf, void *v)
+{
+	struct ccp_history *hist = seqf->private;
 
-	return 0;
+	mutex_unlock(&hist->mutex);
 }
 
-/* read temp sensor connection status */
-static int get_temp_cnct(struct ccp_device *ccp)
+static int history_show(struct seq_file *seqf, void *v)
 {
-	int channel;
-	int mode;
-	int ret;
+	ccp_history_show_block(seqf, v);
 
-	ret = send_usb_cmd(ccp, CTL_GET_TMP_CNCT, 0, 0, 0);
-	if (ret)
-		return ret;
+	return 0;
+}
 
-	for (channel = 0; channel < NUM_TEMP_SENSORS; channel++) {
-		mode = ccp->buffer[channel + 1];
-		if (mode == 0)
-			continue;
+static const struct seq_operations history_sops = {
+	.start = history_start,
+	.next = history_next,
+	.stop = history_stop,
+	.show = history_show,
+};
+DEFINE_SEQ_ATTRIBUTE(history);
 
-		set_bit(channel, ccp->temp_cnct);
-	}
+static int history_size_get(void *data, u64 *val)
+{
+	struct ccp_history *hist = data;
+
+	mutex_lock(&hist->mutex);
+	*val = (u64)hist->nblocks * HIST_BLOCK_SIZE;
+	mutex_unlock(&hist->mutex);
 
 	return 0;
 }
 
-/* read firmware version */
-static int get_fw_version(struct ccp_device *ccp)
+/* setting the size drops the history, 0 stops recording */
+static int history_size_set(void *data, u64 val)
 {
-	int ret;
+	struct ccp_history *hist = data;
+	int nblocks = div_u64(val, HIST_BLOCK_SIZE);
+	u8 *buf = NULL;
 
-	ret = send_usb_cmd(ccp, CTL_GET_FW_VER, 0, 0, 0);
-	if (ret) {
-		hid_notice(ccp->hdev, "Failed to read firmware version.\n");
-		return ret;
+	if (val > HIST_MAX_SIZE)
+		return -EINVAL;
+
+	if (nblocks) {
+		buf = vmalloc(nblocks * HIST_BLOCK_SIZE);
+		if (!buf)
+			return -ENOMEM;
 	}
-	ccp->firmware_ver[0] = ccp->buffer[1];
-	ccp->firmware_ver[1] = ccp->buffer[2];
-	ccp->firmware_ver[2] = ccp->buffer[3];
+
+	mutex_lock(&hist->mutex);
+	vfree(hist->buf);
+	hist->buf = buf;
+	hist->nblocks = nblocks;
+	hist->head = 0;
+	hist->count = 0;
+	hist->samples = 0;
+	if (buf)
+		mod_delayed_work(system_wq, &hist->work, 0);
+	mutex_unlock(&hist->mutex);
 
 	return 0;
 }
+DEFINE_DEBUGFS_ATTRIBUTE(history_size_fops, history_size_get, history_size_set, "%llu\n");
 
-/* read bootloader version */
-static int get_bl_version(struct ccp_device *ccp)
+static int history_samples_get(void *data, u64 *val)
 {
-	int ret;
+	struct ccp_history *hist = data;
 
-	ret = send_usb_cmd(ccp, CTL_GET_BL_VER, 0, 0, 0);
-	if (ret) {
-		hid_notice(ccp->hdev, "Failed to read bootloader version.\n");
-		return ret;
-	}
-	ccp->bootloader_ver[0] = ccp->buffer[1];
-	ccp->bootloader_ver[1] = ccp->buffer[2];
+	mutex_lock(&hist->mutex);
+	*val = hist->samples;
+	mutex_unlock(&hist->mutex);
 
 	return 0;
 }
+DEFINE_DEBUGFS_ATTRIBUTE(history_samples_fops, history_samples_get, NULL, "%llu\n");
+
+static void ccp_history_init(struct ccp_device *ccp)
+{
+	mutex_init(&ccp->history.mutex);
+	INIT_DELAYED_WORK(&ccp->history.work, ccp_history_work);
+}
+
+/* the debugfs files have to be gone */
+static void ccp_history_destroy(struct ccp_device *ccp)
+{
+	cancel_delayed_work_sync(&ccp->history.work);
+	vfree(ccp->history.buf);
+}
 
 static int firmware_show(struct seq_file *seqf, void *unused)
 {
@@ -561,7 +3953,42 @@ static int bootloader_show(struct seq_file *seqf, void *unused)
 }
 DEFINE_SHOW_ATTRIBUTE(bootloader);
 
-static void ccp_debugfs_init(struct ccp_device *ccp)
+static int capabilities_show(struct seq_file *seqf, void *unused)
+{
+	struct ccp_device *ccp = seqf->private;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(ccp_cap_names); i++)
+		if (ccp->caps & BIT(i))
+			seq_printf(seqf, "%s\n", ccp_cap_names[i]);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(capabilities);
+
+static int led_stats_show(struct seq_file *seqf, void *unused)
+{
+	struct ccp_device *ccp = seqf->private;
+	struct ccp_led_stats stats;
+
+	mutex_lock(&ccp->led_mutex);
+	stats = ccp->led_stats;
+	mutex_unlock(&ccp->led_mutex);
+
+	seq_printf(seqf, "frames: %llu\n", stats.frames);
+	seq_printf(seqf, "reports: %llu\n", stats.reports);
+	seq_printf(seqf, "reports_full: %llu\n", stats.reports_full);
+	seq_printf(seqf, "dropped: %llu\n", READ_ONCE(ccp->stream.dropped));
+	if (stats.frames)
+		seq_printf(seqf, "reports_per_frame: %llu.%02llu\n",
+			   div64_u64(stats.reports, stats.frames),
+			   div64_u64(stats.reports % stats.frames * 100, stats.frames));
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(led_stats);
+
+static void ccp_debugfs_init(struct ccp_device *ccp, bool have_fw_version)
 {
 	char name[32];
 	int ret;
@@ -569,8 +3996,7 @@ static void ccp_debugfs_init(struct ccp_device *ccp)
 	scnprintf(name, sizeof(name), "corsaircpro-%s", dev_name(&ccp->hdev->dev));
 	ccp->debugfs = debugfs_create_dir(name, NULL);
 
-	ret = get_fw_version(ccp);
-	if (!ret)
+	if (have_fw_version)
 		debugfs_create_file("firmware_version", 0444,
 				    ccp->debugfs, ccp, &firmware_fops);
 
@@ -578,6 +4004,19 @@ static void ccp_debugfs_init(struct ccp_device *ccp)
 	if (!ret)
 		debugfs_create_file("bootloader_version", 0444,
 				    ccp->debugfs, ccp, &bootloader_fops);
+
+	debugfs_create_file("capabilities", 0444, ccp->debugfs, ccp, &capabilities_fops);
+	if (ccp->caps & CCP_CAP_LED)
+		debugfs_create_file("led_stats", 0444, ccp->debugfs, ccp, &led_stats_fops);
+	if (ccp->info->hwmon_name) {
+		debugfs_create_file("history", 0400, ccp->debugfs, &ccp->history,
+				    &history_fops);
+		debugfs_create_file_unsafe("history_size", 0600, ccp->debugfs, &ccp->history,
+					   &history_size_fops);
+		debugfs_create_file_unsafe("history_samples", 0400, ccp->debugfs,
+					   &ccp->history, &history_samples_fops);
+	}
+	ccp_core_debugfs_init(&ccp->core, ccp->debugfs);
 }
 
 static int ccp_probe(struct hid_device *hdev, const struct hid_device_id *id)
@@ -589,59 +4028,99 @@ static int ccp_probe(struct hid_device *hdev, const struct hid_device_id *id)
 	if (!ccp)
 		return -ENOMEM;
 
-	ccp->cmd_buffer = devm_kmalloc(&hdev->dev, OUT_BUFFER_SIZE, GFP_KERNEL);
-	if (!ccp->cmd_buffer)
-		return -ENOMEM;
+	ccp->hdev = hdev;
+	ccp->info = (const struct ccp_device_info *)id->driver_data;
 
-	ccp->buffer = devm_kmalloc(&hdev->dev, IN_BUFFER_SIZE, GFP_KERNEL);
-	if (!ccp->buffer)
-		return -ENOMEM;
+	ret = ccp_core_init(&ccp->core, hdev);
+	if (ret)
+		return ret;
 
 	ret = hid_parse(hdev);
 	if (ret)
-		return ret;
+		goto out_core_destroy;
 
 	ret = hid_hw_start(hdev, HID_CONNECT_HIDRAW);
 	if (ret)
-		return ret;
+		goto out_core_destroy;
 
 	ret = hid_hw_open(hdev);
 	if (ret)
 		goto out_hw_stop;
 
-	ccp->hdev = hdev;
 	hid_set_drvdata(hdev, ccp);
 
 	mutex_init(&ccp->mutex);
-	spin_lock_init(&ccp->wait_input_report_lock);
-	init_completion(&ccp->wait_input_report);
+	mutex_init(&ccp->led_mutex);
+	ccp_led_stream_init(ccp);
+	INIT_WORK(&ccp->warm_work, ccp_warm_work);
+	INIT_WORK(&ccp->readahead_work, ccp_readahead_work);
+	ccp_history_init(ccp);
+	ccp_init_curves(ccp);
+	ccp_target_init(ccp);
+	ccp_opt_init(ccp);
 
 	hid_device_io_start(hdev);
 
-	/* temp and fan connection status only updates when device is powered on */
-	ret = get_temp_cnct(ccp);
-	if (ret)
-		goto out_hw_close;
+	if (ccp->info->hwmon_name) {
+		/* temp and fan connection status only updates when device is powered on */
+		ret = get_temp_cnct(ccp);
+		if (ret)
+			goto out_hw_close;
 
-	ret = get_fan_cnct(ccp);
-	if (ret)
-		goto out_hw_close;
+		ret = get_fan_cnct(ccp);
+		if (ret)
+			goto out_hw_close;
+	}
 
-	ccp_debugfs_init(ccp);
+	ccp->caps = ccp->info->caps;
+	ret = get_fw_version(ccp);
+	if (batch)
+		ccp->caps |= CCP_CAP_BATCH;
+
+	ccp_core_set_depth(&ccp->core, ccp->caps & CCP_CAP_BATCH ? CCP_MAX_INFLIGHT : 1);
+
+	ccp_debugfs_init(ccp, !ret);
+
+	if (ccp->caps & CCP_CAP_LED) {
+		ret = sysfs_create_group(&hdev->dev.kobj, &ccp_led_group);
+		if (ret)
+			goto out_debugfs_remove;
+	}
+
+	if (ccp->info->hwmon_name) {
+		/* reads arriving before the sweep is done wait for it on ccp->mutex */
+		schedule_work(&ccp->warm_work);
+
+		ccp->hwmon_dev = hwmon_device_register_with_info(&hdev->dev,
+								 ccp->info->hwmon_name, ccp,
+								 &ccp_chip_info, ccp_groups);
+		if (IS_ERR(ccp->hwmon_dev)) {
+			ret = PTR_ERR(ccp->hwmon_dev);
+			goto out_led_remove;
+		}
 
-	ccp->hwmon_dev = hwmon_device_register_with_info(&hdev->dev, "corsaircpro",
-							 ccp, &ccp_chip_info, NULL);
-	if (IS_ERR(ccp->hwmon_dev)) {
-		ret = PTR_ERR(ccp->hwmon_dev);
-		goto out_hw_close;
+		ccp_pmu_register(ccp);
 	}
 
 	return 0;
 
+out_led_remove:
+	cancel_work_sync(&ccp->warm_work);
+	cancel_work_sync(&ccp->readahead_work);
+	if (ccp->caps & CCP_CAP_LED) {
+		sysfs_remove_group(&hdev->dev.kobj, &ccp_led_group);
+		cancel_delayed_work_sync(&ccp->stream.work);
+		cancel_delayed_work_sync(&ccp->indicator_work);
+	}
+out_debugfs_remove:
+	debugfs_remove_recursive(ccp->debugfs);
+	ccp_history_destroy(ccp);
 out_hw_close:
 	hid_hw_close(hdev);
 out_hw_stop:
 	hid_hw_stop(hdev);
+out_core_destroy:
+	ccp_core_destroy(&ccp->core);
 	return ret;
 }
 
@@ -650,14 +4129,44 @@ static void ccp_remove(struct hid_device *hdev)
 	struct ccp_device *ccp = hid_get_drvdata(hdev);
 
 	debugfs_remove_recursive(ccp->debugfs);
-	hwmon_device_unregister(ccp->hwmon_dev);
+	ccp_history_destroy(ccp);
+	if (ccp->caps & CCP_CAP_LED) {
+		sysfs_remove_group(&hdev->dev.kobj, &ccp_led_group);
+		cancel_delayed_work_sync(&ccp->stream.work);
+		cancel_delayed_work_sync(&ccp->indicator_work);
+	}
+	if (ccp->hwmon_dev) {
+		ccp_pmu_unregister(ccp);
+		ccp_target_stop(ccp);
+		ccp_opt_stop(ccp);
+		hwmon_device_unregister(ccp->hwmon_dev);
+	}
+	cancel_work_sync(&ccp->warm_work);
+	cancel_work_sync(&ccp->readahead_work);
 	hid_hw_close(hdev);
 	hid_hw_stop(hdev);
+	ccp_core_destroy(&ccp->core);
 }
 
+static const struct ccp_device_info ccp_cpro_info = {
+	.hwmon_name = "corsaircpro",
+	.caps = CCP_CAP_FAN_CURVE | CCP_CAP_LED,
+};
+
+/* Lighting Node Pro and Core: same protocol, only the two led channels */
+static const struct ccp_device_info ccp_lnp_info = {
+	.caps = CCP_CAP_LED,
+};
+
 static const struct hid_device_id ccp_devices[] = {
-	{ HID_USB_DEVICE(USB_VENDOR_ID_CORSAIR, USB_PRODUCT_ID_CORSAIR_COMMANDERPRO) },
-	{ HID_USB_DEVICE(USB_VENDOR_ID_CORSAIR, USB_PRODUCT_ID_CORSAIR_1000D) },
+	{ HID_USB_DEVICE(USB_VENDOR_ID_CORSAIR, USB_PRODUCT_ID_CORSAIR_COMMANDERPRO),
+	  .driver_data = (kernel_ulong_t)&ccp_cpro_info },
+	{ HID_USB_DEVICE(USB_VENDOR_ID_CORSAIR, USB_PRODUCT_ID_CORSAIR_1000D),
+	  .driver_data = (kernel_ulong_t)&ccp_cpro_info },
+	{ HID_USB_DEVICE(USB_VENDOR_ID_CORSAIR, USB_PRODUCT_ID_CORSAIR_LNP),
+	  .driver_data = (kernel_ulong_t)&ccp_lnp_info },
+	{ HID_USB_DEVICE(USB_VENDOR_ID_CORSAIR, USB_PRODUCT_ID_CORSAIR_LN_CORE),
+	  .driver_data = (kernel_ulong_t)&ccp_lnp_info },
 	{ }
 };
 
@@ -670,7 +4179,7 @@ static struct hid_driver ccp_driver = {
 };
 
 MODULE_DEVICE_TABLE(hid, ccp_devices);
-MODULE_DESCRIPTION("Corsair Commander Pro controller driver");
+MODULE_DESCRIPTION("Corsair Commander Pro and Lighting Node controller driver");
 MODULE_LICENSE("GPL");
 
 static int __init ccp_init(void)
@@ -681,6 +4190,7 @@ static int __init ccp_init(void)
 static void __exit ccp_exit(void)
 {
 	hid_unregister_driver(&ccp_driver);
+	ccp_pmu_exit();
 }
 
 /*
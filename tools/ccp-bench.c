@@ -0,0 +1,637 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * ccp-bench.c - fan control quality benchmark against the ccp-emu thermal model
+ *
+ * Runs each control policy against a fresh ccp-emu device with the same heat step and
+ * reports how well and how cheaply it controls the temperature of the heat source:
+ *
+ * - fancontrol: userspace loop like lm-sensors fancontrol, linear temp to pwm mapping,
+ *   all pwm values written every interval
+ * - driver: fan curve in the device through pwmX_auto_point* and pwmX_enable = 2,
+ *   nothing to do for userspace afterwards
+ * - pi: userspace PI loop on pwm holding a temperature setpoint
+ *
+ * Output is one CSV line per policy:
+ * policy,settle_s,overshoot_k,peak_c,final_c,cmds_per_min,cpu_ms
+ *
+ * settle_s is the time from the heat step until the source temperature stays within
+ * the band around its final value, commands are counted by the emulator, cpu_ms is the
+ * time the control loop spent in user and kernel mode.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HWMON_ROOT	"/sys/class/hwmon"
+#define NUM_FANS	6
+#define NUM_POINTS	6
+#define MAX_DIRS	64
+
+struct bench {
+	const char *emu;
+	double duration;	/* simulated s per policy */
+	double speed;		/* simulated s per real s */
+	double p0, p1;		/* heat before and after the step in W */
+	double step;		/* simulated s */
+	double band;		/* K */
+	double min_temp, max_temp;	/* C, curve of fancontrol and driver */
+	int min_pwm, max_pwm;
+	int min_rpm, max_rpm;	/* curve of driver */
+	double setpoint;	/* C, pi */
+	double kp, ki;		/* pwm per K, pwm per K s */
+	double interval;	/* simulated s between userspace control steps */
+	const char *outdir;
+	char **emu_args;
+	int emu_argc;
+
+	/* per run */
+	char hwmon[PATH_MAX];
+	int fans[NUM_FANS];
+	double integral;
+	int last_pwm;
+};
+
+struct policy {
+	const char *name;
+	int (*setup)(struct bench *b);
+	int (*step)(struct bench *b, double dt);
+};
+
+struct result {
+	double settle;
+	double overshoot;
+	double peak;
+	double final;
+	double cmds_per_min;
+	double cpu_ms;
+};
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sleep_s(double s)
+{
+	struct timespec ts;
+
+	if (s <= 0)
+		return;
+	ts.tv_sec = s;
+	ts.tv_nsec = (s - ts.tv_sec) * 1e9;
+	nanosleep(&ts, NULL);
+}
+
+static int sysfs_read(const char *dir, const char *attr, long *val)
+{
+	char path[PATH_MAX + 64], buf[32];
+	ssize_t n;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, attr);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return n ? -errno : -EIO;
+	buf[n] = '\0';
+	*val = strtol(buf, NULL, 10);
+
+	return 0;
+}
+
+static int sysfs_write(const char *dir, const char *attr, long val)
+{
+	char path[PATH_MAX + 64], buf[32];
+	int fd, len, ret = 0;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, attr);
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -errno;
+	len = snprintf(buf, sizeof(buf), "%ld", val);
+	if (write(fd, buf, len) != len)
+		ret = -errno;
+	close(fd);
+
+	return ret;
+}
+
+static int is_ccp_hwmon(const char *name)
+{
+	char dir[PATH_MAX], buf[32] = "";
+	FILE *fp;
+
+	snprintf(dir, sizeof(dir), "%s/%s/name", HWMON_ROOT, name);
+	fp = fopen(dir, "r");
+	if (!fp)
+		return 0;
+	if (!fgets(buf, sizeof(buf), fp))
+		buf[0] = '\0';
+	fclose(fp);
+
+	return !strcmp(buf, "corsaircpro\n");
+}
+
+/* lists the corsaircpro hwmon directories */
+static int list_hwmon(char names[][32], int max)
+{
+	struct dirent *de;
+	DIR *dir;
+	int n = 0;
+
+	dir = opendir(HWMON_ROOT);
+	if (!dir)
+		return 0;
+	while ((de = readdir(dir)) && n < max) {
+		if (strncmp(de->d_name, "hwmon", 5) || !is_ccp_hwmon(de->d_name))
+			continue;
+		snprintf(names[n++], 32, "%.31s", de->d_name);
+	}
+	closedir(dir);
+
+	return n;
+}
+
+/* waits for a corsaircpro hwmon directory which was not in old */
+static int wait_hwmon(struct bench *b, char old[][32], int n_old, pid_t emu)
+{
+	char names[MAX_DIRS][32];
+	double end = now_s() + 10;
+	int i, j, n;
+
+	while (now_s() < end) {
+		if (waitpid(emu, NULL, WNOHANG) == emu)
+			return -ECHILD;
+		n = list_hwmon(names, MAX_DIRS);
+		for (i = 0; i < n; i++) {
+			for (j = 0; j < n_old; j++)
+				if (!strcmp(names[i], old[j]))
+					break;
+			if (j == n_old) {
+				snprintf(b->hwmon, sizeof(b->hwmon), "%s/%s", HWMON_ROOT, names[i]);
+				return 0;
+			}
+		}
+		sleep_s(0.05);
+	}
+
+	return -ETIMEDOUT;
+}
+
+static void find_fans(struct bench *b)
+{
+	char attr[16];
+	long val;
+	int i;
+
+	for (i = 0; i < NUM_FANS; i++) {
+		snprintf(attr, sizeof(attr), "fan%d_input", i + 1);
+		b->fans[i] = !sysfs_read(b->hwmon, attr, &val);
+	}
+}
+
+static int write_all_pwm(struct bench *b, long pwm)
+{
+	char attr[16];
+	int i, ret;
+
+	for (i = 0; i < NUM_FANS; i++) {
+		if (!b->fans[i])
+			continue;
+		snprintf(attr, sizeof(attr), "pwm%d", i + 1);
+		ret = sysfs_write(b->hwmon, attr, pwm);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int read_temp(struct bench *b, double *temp)
+{
+	long val;
+	int ret;
+
+	ret = sysfs_read(b->hwmon, "temp1_input", &val);
+	if (!ret)
+		*temp = val / 1000.0;
+
+	return ret;
+}
+
+static int fancontrol_step(struct bench *b, double dt)
+{
+	double t, x;
+	int ret;
+
+	(void)dt;
+	ret = read_temp(b, &t);
+	if (ret)
+		return ret;
+
+	x = (t - b->min_temp) / (b->max_temp - b->min_temp);
+	x = x < 0 ? 0 : x > 1 ? 1 : x;
+
+	/* fancontrol writes every interval whether the value changed or not */
+	return write_all_pwm(b, lround(b->min_pwm + x * (b->max_pwm - b->min_pwm)));
+}
+
+static int driver_setup(struct bench *b)
+{
+	char attr[48];
+	double x;
+	int i, j, ret;
+
+	for (i = 0; i < NUM_FANS; i++) {
+		if (!b->fans[i])
+			continue;
+		for (j = 0; j < NUM_POINTS; j++) {
+			x = (double)j / (NUM_POINTS - 1);
+			snprintf(attr, sizeof(attr), "pwm%d_auto_point%d_temp", i + 1, j + 1);
+			ret = sysfs_write(b->hwmon, attr,
+					  lround((b->min_temp + x * (b->max_temp - b->min_temp)) * 1000));
+			if (ret)
+				return ret;
+			snprintf(attr, sizeof(attr), "pwm%d_auto_point%d_rpm", i + 1, j + 1);
+			ret = sysfs_write(b->hwmon, attr,
+					  lround(b->min_rpm + x * (b->max_rpm - b->min_rpm)));
+			if (ret)
+				return ret;
+		}
+		snprintf(attr, sizeof(attr), "pwm%d_enable", i + 1);
+		ret = sysfs_write(b->hwmon, attr, 2);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int pi_setup(struct bench *b)
+{
+	b->integral = 0;
+	b->last_pwm = -1;
+	return 0;
+}
+
+static int pi_step(struct bench *b, double dt)
+{
+	double t, e, u;
+	long pwm;
+	int ret;
+
+	ret = read_temp(b, &t);
+	if (ret)
+		return ret;
+
+	e = t - b->setpoint;
+	u = b->kp * e + b->ki * (b->integral + e * dt);
+	/* anti windup: stop integrating while saturated */
+	if (u >= 0 && u <= 255)
+		b->integral += e * dt;
+	pwm = lround(u < 0 ? 0 : u > 255 ? 255 : u);
+
+	if (pwm == b->last_pwm)
+		return 0;
+	b->last_pwm = pwm;
+
+	return write_all_pwm(b, pwm);
+}
+
+static const struct policy policies[] = {
+	{ "fancontrol", NULL, fancontrol_step },
+	{ "driver", driver_setup, NULL },
+	{ "pi", pi_setup, pi_step },
+};
+
+static pid_t start_emu(struct bench *b, const char *trace)
+{
+	char heat[96], duration[32], speed[32];
+	char *argv[32 + 16];
+	int argc = 0, i;
+	pid_t pid;
+
+	snprintf(heat, sizeof(heat), "step:%g:%g:%g", b->p0, b->p1, b->step);
+	snprintf(duration, sizeof(duration), "%g", b->duration + 30);
+	snprintf(speed, sizeof(speed), "%g", b->speed);
+
+	argv[argc++] = (char *)b->emu;
+	argv[argc++] = "--heat";
+	argv[argc++] = heat;
+	argv[argc++] = "--trace";
+	argv[argc++] = (char *)trace;
+	argv[argc++] = "--trace-interval";
+	argv[argc++] = "0.1";
+	argv[argc++] = "--duration";
+	argv[argc++] = duration;
+	argv[argc++] = "--speed";
+	argv[argc++] = speed;
+	for (i = 0; i < b->emu_argc && i < 32; i++)
+		argv[argc++] = b->emu_args[i];
+	argv[argc] = NULL;
+
+	pid = fork();
+	if (pid == 0) {
+		execv(b->emu, argv);
+		perror(b->emu);
+		_exit(127);
+	}
+
+	return pid;
+}
+
+/* time,power,t_src,t_case,rpm1,duty1,...,rpm6,duty6,commands as written by ccp-emu */
+static int analyze(struct bench *b, const char *trace, struct result *r)
+{
+	double *time = NULL, *temp = NULL, t, src, final = 0, tmp;
+	unsigned long cmds = 0, c;
+	size_t n = 0, cap = 0, i, tail;
+	char line[512], *p;
+	FILE *fp;
+	int k;
+
+	fp = fopen(trace, "r");
+	if (!fp)
+		return -errno;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%lf,%*f,%lf", &t, &src) != 2)
+			continue;
+		/* the commands counter is the last column */
+		p = strrchr(line, ',');
+		c = p ? strtoul(p + 1, NULL, 10) : 0;
+		if (n == cap) {
+			cap = cap ? 2 * cap : 4096;
+			p = realloc(time, cap * sizeof(*time));
+			if (p)
+				time = (double *)p;
+			p = p ? realloc(temp, cap * sizeof(*temp)) : NULL;
+			if (!p) {
+				free(time);
+				free(temp);
+				fclose(fp);
+				return -ENOMEM;
+			}
+			temp = (double *)p;
+		}
+		time[n] = t;
+		temp[n] = src;
+		cmds = c;
+		n++;
+	}
+	fclose(fp);
+
+	if (n < 10) {
+		free(time);
+		free(temp);
+		return -ENODATA;
+	}
+
+	tail = n / 10;
+	for (i = n - tail; i < n; i++)
+		final += temp[i];
+	final /= tail;
+
+	memset(r, 0, sizeof(*r));
+	r->final = final;
+	r->peak = -INFINITY;
+	for (i = 0, k = 0; i < n; i++) {
+		if (time[i] < b->step)
+			continue;
+		if (temp[i] > r->peak)
+			r->peak = temp[i];
+		if (fabs(temp[i] - final) > b->band)
+			r->settle = time[i] - b->step;
+		k++;
+	}
+	tmp = r->peak - final;
+	r->overshoot = tmp > 0 ? tmp : 0;
+	r->cmds_per_min = cmds / (time[n - 1] / 60);
+
+	free(time);
+	free(temp);
+	return k ? 0 : -ENODATA;
+}
+
+static int run_policy(struct bench *b, const struct policy *pol, struct result *r)
+{
+	char old[MAX_DIRS][32], trace[PATH_MAX];
+	struct rusage ru0, ru1;
+	double start, next, last;
+	int n_old, ret = 0, status;
+	pid_t emu;
+
+	snprintf(trace, sizeof(trace), "%s/%s.csv", b->outdir, pol->name);
+	n_old = list_hwmon(old, MAX_DIRS);
+
+	emu = start_emu(b, trace);
+	if (emu < 0)
+		return -errno;
+
+	ret = wait_hwmon(b, old, n_old, emu);
+	if (ret) {
+		fprintf(stderr, "%s: no corsaircpro hwmon device appeared\n", pol->name);
+		goto out_kill;
+	}
+	find_fans(b);
+
+	getrusage(RUSAGE_SELF, &ru0);
+	start = now_s();
+
+	if (pol->setup) {
+		ret = pol->setup(b);
+		if (ret)
+			goto out_err;
+	}
+
+	last = start;
+	next = start;
+	while (now_s() - start < b->duration / b->speed) {
+		if (pol->step) {
+			ret = pol->step(b, (now_s() - last) * b->speed);
+			last = now_s();
+			if (ret)
+				goto out_err;
+		}
+		next += b->interval / b->speed;
+		sleep_s(next - now_s());
+	}
+
+	getrusage(RUSAGE_SELF, &ru1);
+	r->cpu_ms = (ru1.ru_utime.tv_sec - ru0.ru_utime.tv_sec) * 1e3 +
+		    (ru1.ru_utime.tv_usec - ru0.ru_utime.tv_usec) / 1e3 +
+		    (ru1.ru_stime.tv_sec - ru0.ru_stime.tv_sec) * 1e3 +
+		    (ru1.ru_stime.tv_usec - ru0.ru_stime.tv_usec) / 1e3;
+	goto out_kill;
+
+out_err:
+	fprintf(stderr, "%s: %s\n", pol->name, strerror(-ret));
+out_kill:
+	kill(emu, SIGTERM);
+	waitpid(emu, &status, 0);
+	if (ret)
+		return ret;
+
+	return analyze(b, trace, r);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options] [-- emulator options]\n"
+		"  -e EMU        ccp-emu binary (default: next to this program)\n"
+		"  -p LIST       comma separated policies: fancontrol,driver,pi (default all)\n"
+		"  -d S          simulated seconds per policy (default 600)\n"
+		"  -x SPEED      emulator speed, control intervals are scaled along;\n"
+		"                sensor caching in the driver is not (default 1)\n"
+		"  -P W0:W1      heat before and after the step (default 40:150)\n"
+		"  -s S          time of the heat step (default 60)\n"
+		"  -b K          settling band (default 0.5)\n"
+		"  -T MIN:MAX    temperature range of fancontrol and driver curve (default 30:60)\n"
+		"  -w MIN:MAX    pwm range of fancontrol (default 60:255)\n"
+		"  -r MIN:MAX    rpm range of the driver curve (default 600:1800)\n"
+		"  -S C          setpoint of pi (default 50)\n"
+		"  -K KP:KI      gains of pi in pwm per K and pwm per K s (default 20:0.5)\n"
+		"  -i S          userspace control interval (default 2)\n"
+		"  -o DIR        directory for the emulator traces (default .)\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	static char emu_path[PATH_MAX];
+	struct bench b = {
+		.duration = 600,
+		.speed = 1,
+		.p0 = 40,
+		.p1 = 150,
+		.step = 60,
+		.band = 0.5,
+		.min_temp = 30,
+		.max_temp = 60,
+		.min_pwm = 60,
+		.max_pwm = 255,
+		.min_rpm = 600,
+		.max_rpm = 1800,
+		.setpoint = 50,
+		.kp = 20,
+		.ki = 0.5,
+		.interval = 2,
+		.outdir = ".",
+	};
+	const char *list = "fancontrol,driver,pi";
+	struct result r;
+	char *slash;
+	size_t i;
+	int opt, ret, failed = 0;
+
+	while ((opt = getopt(argc, argv, "e:p:d:x:P:s:b:T:w:r:S:K:i:o:h")) != -1) {
+		switch (opt) {
+		case 'e':
+			b.emu = optarg;
+			break;
+		case 'p':
+			list = optarg;
+			break;
+		case 'd':
+			b.duration = atof(optarg);
+			break;
+		case 'x':
+			b.speed = atof(optarg);
+			break;
+		case 'P':
+			sscanf(optarg, "%lf:%lf", &b.p0, &b.p1);
+			break;
+		case 's':
+			b.step = atof(optarg);
+			break;
+		case 'b':
+			b.band = atof(optarg);
+			break;
+		case 'T':
+			sscanf(optarg, "%lf:%lf", &b.min_temp, &b.max_temp);
+			break;
+		case 'w':
+			sscanf(optarg, "%d:%d", &b.min_pwm, &b.max_pwm);
+			break;
+		case 'r':
+			sscanf(optarg, "%d:%d", &b.min_rpm, &b.max_rpm);
+			break;
+		case 'S':
+			b.setpoint = atof(optarg);
+			break;
+		case 'K':
+			sscanf(optarg, "%lf:%lf", &b.kp, &b.ki);
+			break;
+		case 'i':
+			b.interval = atof(optarg);
+			break;
+		case 'o':
+			b.outdir = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	b.emu_args = &argv[optind];
+	b.emu_argc = argc - optind;
+
+	if (b.duration <= b.step || b.speed <= 0 || b.interval <= 0 ||
+	    b.max_temp <= b.min_temp) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (!b.emu) {
+		snprintf(emu_path, sizeof(emu_path), "%s", argv[0]);
+		slash = strrchr(emu_path, '/');
+		if (slash)
+			snprintf(slash + 1, sizeof(emu_path) - (slash + 1 - emu_path), "ccp-emu");
+		else
+			snprintf(emu_path, sizeof(emu_path), "./ccp-emu");
+		b.emu = emu_path;
+	}
+
+	printf("policy,settle_s,overshoot_k,peak_c,final_c,cmds_per_min,cpu_ms\n");
+
+	for (i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+		const char *p = strstr(list, policies[i].name);
+		size_t len = strlen(policies[i].name);
+
+		if (!p || (p != list && p[-1] != ',') || (p[len] && p[len] != ','))
+			continue;
+
+		memset(&r, 0, sizeof(r));
+		ret = run_policy(&b, &policies[i], &r);
+		if (ret) {
+			fprintf(stderr, "%s failed: %s\n", policies[i].name, strerror(-ret));
+			failed = 1;
+			continue;
+		}
+
+		printf("%s,%.1f,%.2f,%.2f,%.2f,%.1f,%.1f\n", policies[i].name, r.settle,
+		       r.overshoot, r.peak, r.final, r.cmds_per_min, r.cpu_ms);
+		fflush(stdout);
+	}
+
+	return failed;
+}
@@ -0,0 +1,1003 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * ccp-emu.c - uhid emulator of the Corsair Commander Pro with a thermal and fan model
+ *
+ * Creates a virtual Commander Pro through /dev/uhid, so the corsair-cpro driver binds to it,
+ * and answers its commands from a simulation:
+ *
+ * - a heat source (e.g. a CPU with its heatsink) driven by a heat input profile, coupled to
+ *   the case air, which exchanges heat with the ambient air moved by the fans
+ * - six fan channels, each 3pin (voltage controlled, stalls below a start duty) or
+ *   4pin (pwm controlled, keeps a minimum speed), with its own duty to rpm curve and
+ *   a first order lag
+ * - fixed pwm (CTL_SET_FAN_FPWM), target rpm (CTL_SET_FAN_TARGET) and fan curve
+ *   (CTL_SET_FAN_CURVE) control, the latter two by a device internal integral controller
+ *
+ * The model is integrated in fixed steps of simulated time, so runs with the same command
+ * timing give the same results. Responses are delayed by a per command latency and sent
+ * in command order, like the real device.
+ *
+ * With --tag every response carries the opcode and the last byte of its frame in bytes 14
+ * and 15, which the commands known to the driver leave unused, so clients can tell whose
+ * response they got.
+ *
+ * With --replay the responses and their timing are taken from a corsair-cpro debugfs
+ * capture log instead, as long as the driver sends the recorded frames in order.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <linux/uhid.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define OUT_BUFFER_SIZE		63
+#define IN_BUFFER_SIZE		16
+#define NUM_FANS		6
+#define NUM_TEMP_SENSORS	4
+#define NUM_VOLTS		3
+#define MAX_PENDING		64
+#define REPLAY_WINDOW		64	/* records searched for the response to a frame */
+
+#define SIM_STEP		0.01	/* s of simulated time per integration step */
+#define AIR_W_PER_CFM		0.57	/* heat carried by 1 CFM of air per K */
+
+#define CTL_GET_FW_VER		0x02
+#define CTL_GET_BL_VER		0x06
+#define CTL_GET_TMP_CNCT	0x10
+#define CTL_GET_TMP		0x11
+#define CTL_GET_VOLT		0x12
+#define CTL_GET_FAN_CNCT	0x20
+#define CTL_GET_FAN_RPM		0x21
+#define CTL_GET_FAN_PWM		0x22
+#define CTL_SET_FAN_FPWM	0x23
+#define CTL_SET_FAN_TARGET	0x24
+#define CTL_SET_FAN_CURVE	0x25
+#define NUM_CURVE_POINTS	6
+
+/* vendor page, 16 byte input report, 63 byte output report, no report ids */
+static const uint8_t report_desc[] = {
+	0x06, 0x42, 0xff,	/* Usage Page (Vendor 0xff42) */
+	0x09, 0x01,		/* Usage (1) */
+	0xa1, 0x01,		/* Collection (Application) */
+	0x09, 0x02,		/*   Usage (2) */
+	0x15, 0x00,		/*   Logical Minimum (0) */
+	0x26, 0xff, 0x00,	/*   Logical Maximum (255) */
+	0x75, 0x08,		/*   Report Size (8) */
+	0x95, IN_BUFFER_SIZE,	/*   Report Count */
+	0x81, 0x02,		/*   Input (Data, Var, Abs) */
+	0x09, 0x03,		/*   Usage (3) */
+	0x95, OUT_BUFFER_SIZE,	/*   Report Count */
+	0x91, 0x02,		/*   Output (Data, Var, Abs) */
+	0xc0,			/* End Collection */
+};
+
+enum fan_mode {
+	FAN_FPWM,
+	FAN_TARGET,
+	FAN_CURVE,
+};
+
+struct fan {
+	int type;		/* 0 not connected, 3 3pin, 4 4pin */
+	double min_rpm;		/* 4pin: speed at 0% duty */
+	double max_rpm;		/* speed at 100% duty */
+	double start_duty;	/* 3pin: stalls below this duty in % */
+	double gamma;		/* shape of the duty to rpm curve */
+	double tau;		/* time constant of the speed in s */
+	double cfm;		/* airflow at max_rpm */
+	enum fan_mode mode;
+	double duty;		/* 0-100 */
+	int target;
+	int curve_sensor;
+	double curve_temp[NUM_CURVE_POINTS];	/* C */
+	double curve_rpm[NUM_CURVE_POINTS];
+	double rpm;
+};
+
+enum heat_shape {
+	HEAT_CONST,
+	HEAT_STEP,
+	HEAT_SQUARE,
+	HEAT_SINE,
+	HEAT_RAMP,
+};
+
+struct heat_profile {
+	enum heat_shape shape;
+	double p0, p1;		/* W */
+	double t;		/* step time, period or ramp length in s */
+};
+
+struct model {
+	struct fan fans[NUM_FANS];
+	struct heat_profile heat;
+	unsigned int probes;	/* bitmap of connected temperature probes */
+	double ambient;		/* C */
+	double c_src;		/* J/K of the heat source */
+	double c_case;		/* J/K of the case */
+	double g_src;		/* W/K from the source to the case air without airflow */
+	double g_src_cfm;	/* additional W/K per CFM */
+	double g_case;		/* W/K from the case to the ambient without airflow */
+	double t_src;
+	double t_case;
+	double time;		/* simulated s */
+	double power;		/* current heat input */
+	double noise;		/* standard deviation of readings in K and rpm */
+	double target_gain;	/* %duty per rpm error per s of the target controller */
+};
+
+struct pending {
+	double due;		/* simulated s */
+	uint8_t data[IN_BUFFER_SIZE];
+};
+
+/* one recorded frame and its response */
+struct replay_cmd {
+	uint32_t seq;
+	uint8_t frame[2];	/* opcode and channel */
+	uint8_t reply[IN_BUFFER_SIZE];
+	int answered;
+	double latency;		/* s */
+};
+
+struct emu {
+	struct model m;
+	int fd;
+	int opened;
+	uint8_t fw[3];
+	uint8_t bl[2];
+	uint16_t product;
+	int tag;
+	double speed;		/* simulated s per real s */
+	double latency;		/* s per command */
+	double op_latency[256];	/* s per opcode from ccp-opscan, negative if unknown */
+	int op_invalid[256];
+	struct pending queue[MAX_PENDING];
+	int head, count;
+	double now;		/* simulated s, the model lags up to SIM_STEP behind */
+	double last_due;
+	struct replay_cmd *replay;
+	size_t replay_count;
+	size_t replay_pos;
+	unsigned long replay_mismatch;
+	unsigned long commands;
+	unsigned int seed;
+	FILE *trace;
+	double trace_interval;
+	double next_trace;
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* deterministic gaussian noise, Box-Muller on rand_r() */
+static double gauss(struct emu *e)
+{
+	double u1 = (rand_r(&e->seed) + 1.0) / (RAND_MAX + 2.0);
+	double u2 = (rand_r(&e->seed) + 1.0) / (RAND_MAX + 2.0);
+
+	return sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+}
+
+static double heat_input(const struct heat_profile *h, double t)
+{
+	switch (h->shape) {
+	case HEAT_STEP:
+		return t < h->t ? h->p0 : h->p1;
+	case HEAT_SQUARE:
+		return fmod(t, h->t) < h->t / 2 ? h->p1 : h->p0;
+	case HEAT_SINE:
+		return h->p0 + h->p1 * sin(2 * M_PI * t / h->t);
+	case HEAT_RAMP:
+		return t >= h->t ? h->p1 : h->p0 + (h->p1 - h->p0) * t / h->t;
+	default:
+		return h->p0;
+	}
+}
+
+/* steady state speed for the current duty */
+static double fan_steady_rpm(const struct fan *f)
+{
+	double d = f->duty / 100;
+
+	switch (f->type) {
+	case 3:
+		/* voltage control: the motor does not start below start_duty */
+		if (f->duty < f->start_duty)
+			return 0;
+		return f->max_rpm * pow(d, f->gamma);
+	case 4:
+		return f->min_rpm + (f->max_rpm - f->min_rpm) * pow(d, f->gamma);
+	default:
+		return 0;
+	}
+}
+
+static double probe_temp(const struct model *m, int channel);
+
+/* linear between the points, flat outside of them */
+static double curve_target(const struct model *m, const struct fan *f)
+{
+	double t = probe_temp(m, f->curve_sensor);
+	int i;
+
+	if (t <= f->curve_temp[0])
+		return f->curve_rpm[0];
+
+	for (i = 1; i < NUM_CURVE_POINTS; i++) {
+		if (t > f->curve_temp[i])
+			continue;
+		if (f->curve_temp[i] == f->curve_temp[i - 1])
+			return f->curve_rpm[i];
+		return f->curve_rpm[i - 1] + (f->curve_rpm[i] - f->curve_rpm[i - 1]) *
+		       (t - f->curve_temp[i - 1]) / (f->curve_temp[i] - f->curve_temp[i - 1]);
+	}
+
+	return f->curve_rpm[NUM_CURVE_POINTS - 1];
+}
+
+static void fan_step(struct model *m, struct fan *f, double dt)
+{
+	double ss;
+
+	if (!f->type)
+		return;
+
+	if (f->mode == FAN_CURVE)
+		f->target = lround(curve_target(m, f));
+
+	if (f->mode == FAN_TARGET || f->mode == FAN_CURVE) {
+		f->duty += m->target_gain * (f->target - f->rpm) * dt;
+		if (f->duty < 0)
+			f->duty = 0;
+		if (f->duty > 100)
+			f->duty = 100;
+	}
+
+	ss = fan_steady_rpm(f);
+	f->rpm += (ss - f->rpm) * (1 - exp(-dt / f->tau));
+}
+
+static double airflow(const struct model *m)
+{
+	double cfm = 0;
+	int i;
+
+	for (i = 0; i < NUM_FANS; i++)
+		if (m->fans[i].type && m->fans[i].max_rpm > 0)
+			cfm += m->fans[i].cfm * m->fans[i].rpm / m->fans[i].max_rpm;
+
+	return cfm;
+}
+
+static void model_step(struct model *m, double dt)
+{
+	double cfm, q_src, q_case;
+	int i;
+
+	for (i = 0; i < NUM_FANS; i++)
+		fan_step(m, &m->fans[i], dt);
+
+	cfm = airflow(m);
+	m->power = heat_input(&m->heat, m->time);
+	q_src = (m->g_src + m->g_src_cfm * cfm) * (m->t_src - m->t_case);
+	q_case = (m->g_case + AIR_W_PER_CFM * cfm) * (m->t_case - m->ambient);
+
+	m->t_src += (m->power - q_src) * dt / m->c_src;
+	m->t_case += (q_src - q_case) * dt / m->c_case;
+	m->time += dt;
+}
+
+/* probe 1 on the heat source, 2 in the case, 3 at the intake, 4 at the exhaust */
+static double probe_temp(const struct model *m, int channel)
+{
+	switch (channel) {
+	case 0:
+		return m->t_src;
+	case 1:
+		return m->t_case;
+	case 2:
+		return m->ambient;
+	default:
+		return m->t_case + (m->t_case - m->ambient) / 2;
+	}
+}
+
+static void put_be16(uint8_t *p, double v)
+{
+	long x = lround(v);
+
+	if (x < 0)
+		x = 0;
+	if (x > 0xffff)
+		x = 0xffff;
+	p[0] = x >> 8;
+	p[1] = x;
+}
+
+/* fills the response to one command frame */
+static void handle_cmd(struct emu *e, const uint8_t *cmd, uint8_t *resp)
+{
+	struct model *m = &e->m;
+	int ch = cmd[1];
+	struct fan *f = ch < NUM_FANS ? &m->fans[ch] : NULL;
+	int i;
+
+	memset(resp, 0, IN_BUFFER_SIZE);
+
+	if (e->op_invalid[cmd[0]]) {
+		resp[0] = 0x01;
+		return;
+	}
+
+	switch (cmd[0]) {
+	case CTL_GET_FW_VER:
+		memcpy(&resp[1], e->fw, 3);
+		break;
+	case CTL_GET_BL_VER:
+		memcpy(&resp[1], e->bl, 2);
+		break;
+	case CTL_GET_TMP_CNCT:
+		for (i = 0; i < NUM_TEMP_SENSORS; i++)
+			resp[i + 1] = !!(m->probes & (1 << i));
+		break;
+	case CTL_GET_TMP:
+		if (ch >= NUM_TEMP_SENSORS) {
+			resp[0] = 0x10;
+			break;
+		}
+		if (!(m->probes & (1 << ch))) {
+			resp[0] = 0x11;
+			break;
+		}
+		put_be16(&resp[1], (probe_temp(m, ch) + m->noise * gauss(e)) * 100);
+		break;
+	case CTL_GET_VOLT:
+		if (ch >= NUM_VOLTS) {
+			resp[0] = 0x10;
+			break;
+		}
+		put_be16(&resp[1], (ch == 0 ? 12100 : ch == 1 ? 5020 : 3340) +
+			 m->noise * 10 * gauss(e));
+		break;
+	case CTL_GET_FAN_CNCT:
+		for (i = 0; i < NUM_FANS; i++)
+			resp[i + 1] = m->fans[i].type == 3 ? 1 : m->fans[i].type == 4 ? 2 : 0;
+		break;
+	case CTL_GET_FAN_RPM:
+		if (!f) {
+			resp[0] = 0x10;
+			break;
+		}
+		put_be16(&resp[1], f->rpm > 0 ? f->rpm + m->noise * gauss(e) : 0);
+		break;
+	case CTL_GET_FAN_PWM:
+		if (!f || f->mode != FAN_FPWM) {
+			resp[0] = 0x12;
+			break;
+		}
+		resp[1] = lround(f->duty);
+		break;
+	case CTL_SET_FAN_FPWM:
+		if (!f || cmd[2] > 100) {
+			resp[0] = 0x10;
+			break;
+		}
+		f->mode = FAN_FPWM;
+		f->duty = cmd[2];
+		break;
+	case CTL_SET_FAN_TARGET:
+		if (!f) {
+			resp[0] = 0x10;
+			break;
+		}
+		f->mode = FAN_TARGET;
+		f->target = (cmd[2] << 8) | cmd[3];
+		break;
+	case CTL_SET_FAN_CURVE:
+		if (!f || cmd[2] >= NUM_TEMP_SENSORS) {
+			resp[0] = 0x10;
+			break;
+		}
+		f->mode = FAN_CURVE;
+		f->curve_sensor = cmd[2];
+		for (i = 0; i < NUM_CURVE_POINTS; i++) {
+			f->curve_temp[i] = ((cmd[3 + 2 * i] << 8) | cmd[4 + 2 * i]) / 100.0;
+			f->curve_rpm[i] = (cmd[15 + 2 * i] << 8) | cmd[16 + 2 * i];
+		}
+		break;
+	default:
+		resp[0] = 0x01;
+		break;
+	}
+}
+
+static int uhid_write(int fd, const struct uhid_event *ev)
+{
+	ssize_t ret = write(fd, ev, sizeof(*ev));
+
+	if (ret < 0)
+		return -errno;
+	return ret == sizeof(*ev) ? 0 : -EFAULT;
+}
+
+static int uhid_create(struct emu *e)
+{
+	struct uhid_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_CREATE2;
+	snprintf((char *)ev.u.create2.name, sizeof(ev.u.create2.name),
+		 "Corsair Commander Pro (ccp-emu)");
+	memcpy(ev.u.create2.rd_data, report_desc, sizeof(report_desc));
+	ev.u.create2.rd_size = sizeof(report_desc);
+	ev.u.create2.bus = 0x03;	/* BUS_USB */
+	ev.u.create2.vendor = 0x1b1c;
+	ev.u.create2.product = e->product;
+
+	return uhid_write(e->fd, &ev);
+}
+
+/* latency is in real s, so the device timing does not depend on --speed */
+static void queue_response(struct emu *e, const uint8_t *resp, double latency)
+{
+	struct pending *p;
+	double due;
+
+	if (e->count == MAX_PENDING) {
+		fprintf(stderr, "response queue full, dropping response\n");
+		return;
+	}
+
+	/* the device works through its commands one after another */
+	due = e->now > e->last_due ? e->now : e->last_due;
+	due += latency * e->speed;
+	e->last_due = due;
+
+	p = &e->queue[(e->head + e->count++) % MAX_PENDING];
+	p->due = due;
+	memcpy(p->data, resp, IN_BUFFER_SIZE);
+}
+
+static void send_due_responses(struct emu *e)
+{
+	struct uhid_event ev;
+	struct pending *p;
+
+	while (e->count && e->queue[e->head].due <= e->now) {
+		p = &e->queue[e->head];
+		memset(&ev, 0, sizeof(ev));
+		ev.type = UHID_INPUT2;
+		ev.u.input2.size = IN_BUFFER_SIZE;
+		memcpy(ev.u.input2.data, p->data, IN_BUFFER_SIZE);
+		if (e->opened && uhid_write(e->fd, &ev))
+			perror("uhid input");
+		e->head = (e->head + 1) % MAX_PENDING;
+		e->count--;
+	}
+}
+
+/*
+ * Returns 1 and the recorded response if cmd is the next recorded frame, 0 if that frame
+ * was never answered and -1 if the driver sent something else, which the model answers.
+ * Recorded frames the driver does not send are skipped.
+ */
+static int replay_next(struct emu *e, const uint8_t *cmd, uint8_t *resp, double *latency)
+{
+	const struct replay_cmd *r = NULL;
+	size_t i;
+
+	for (i = e->replay_pos; i < e->replay_count && i < e->replay_pos + REPLAY_WINDOW; i++) {
+		if (!memcmp(e->replay[i].frame, cmd, sizeof(e->replay[i].frame))) {
+			r = &e->replay[i];
+			break;
+		}
+	}
+	if (!r) {
+		if (e->replay_count)
+			e->replay_mismatch++;
+		return -1;
+	}
+	e->replay_pos = i + 1;
+
+	if (!r->answered)
+		return 0;
+
+	memcpy(resp, r->reply, IN_BUFFER_SIZE);
+	*latency = r->latency;
+	return 1;
+}
+
+static void handle_event(struct emu *e)
+{
+	uint8_t cmd[OUT_BUFFER_SIZE] = { 0 };
+	uint8_t resp[IN_BUFFER_SIZE];
+	struct uhid_event ev, reply;
+	const uint8_t *data;
+	double latency;
+	size_t size;
+	ssize_t ret;
+
+	ret = read(e->fd, &ev, sizeof(ev));
+	if (ret <= 0)
+		return;
+
+	switch (ev.type) {
+	case UHID_OPEN:
+		e->opened = 1;
+		break;
+	case UHID_CLOSE:
+		e->opened = 0;
+		break;
+	case UHID_OUTPUT:
+		data = ev.u.output.data;
+		size = ev.u.output.size;
+		/* hidraw clients prefix frames with report number 0 */
+		if (size == OUT_BUFFER_SIZE + 1 && !data[0]) {
+			data++;
+			size--;
+		}
+		memcpy(cmd, data, size < OUT_BUFFER_SIZE ? size : OUT_BUFFER_SIZE);
+		e->commands++;
+		switch (replay_next(e, cmd, resp, &latency)) {
+		case 0:
+			break;
+		case 1:
+			queue_response(e, resp, latency);
+			break;
+		default:
+			handle_cmd(e, cmd, resp);
+			if (e->tag) {
+				resp[IN_BUFFER_SIZE - 2] = cmd[0];
+				resp[IN_BUFFER_SIZE - 1] = cmd[OUT_BUFFER_SIZE - 1];
+			}
+			latency = e->op_latency[cmd[0]] >= 0 ? e->op_latency[cmd[0]] : e->latency;
+			queue_response(e, resp, latency);
+			break;
+		}
+		break;
+	case UHID_GET_REPORT:
+		memset(&reply, 0, sizeof(reply));
+		reply.type = UHID_GET_REPORT_REPLY;
+		reply.u.get_report_reply.id = ev.u.get_report.id;
+		reply.u.get_report_reply.err = EIO;
+		uhid_write(e->fd, &reply);
+		break;
+	case UHID_SET_REPORT:
+		memset(&reply, 0, sizeof(reply));
+		reply.type = UHID_SET_REPORT_REPLY;
+		reply.u.set_report_reply.id = ev.u.set_report.id;
+		reply.u.set_report_reply.err = EIO;
+		uhid_write(e->fd, &reply);
+		break;
+	default:
+		break;
+	}
+}
+
+static void write_trace(struct emu *e)
+{
+	struct model *m = &e->m;
+	int i;
+
+	if (!e->trace || m->time < e->next_trace)
+		return;
+	e->next_trace += e->trace_interval;
+
+	fprintf(e->trace, "%.2f,%.1f,%.3f,%.3f", m->time, m->power, m->t_src, m->t_case);
+	for (i = 0; i < NUM_FANS; i++)
+		fprintf(e->trace, ",%.0f,%.1f", m->fans[i].rpm, m->fans[i].duty);
+	fprintf(e->trace, ",%lu\n", e->commands);
+}
+
+static void write_trace_header(struct emu *e)
+{
+	int i;
+
+	fprintf(e->trace, "time,power,t_src,t_case");
+	for (i = 1; i <= NUM_FANS; i++)
+		fprintf(e->trace, ",rpm%d,duty%d", i, i);
+	fprintf(e->trace, ",commands\n");
+}
+
+static int parse_heat(struct heat_profile *h, const char *arg)
+{
+	char shape[16];
+	int n;
+
+	memset(h, 0, sizeof(*h));
+	n = sscanf(arg, "%15[a-z]:%lf:%lf:%lf", shape, &h->p0, &h->p1, &h->t);
+	if (n >= 2 && !strcmp(shape, "const"))
+		h->shape = HEAT_CONST;
+	else if (n == 4 && !strcmp(shape, "step"))
+		h->shape = HEAT_STEP;
+	else if (n == 4 && !strcmp(shape, "square"))
+		h->shape = HEAT_SQUARE;
+	else if (n == 4 && !strcmp(shape, "sine"))
+		h->shape = HEAT_SINE;
+	else if (n == 4 && !strcmp(shape, "ramp"))
+		h->shape = HEAT_RAMP;
+	else
+		return -EINVAL;
+
+	return h->t < 0 || (h->shape != HEAT_CONST && !h->t) ? -EINVAL : 0;
+}
+
+/* channel:type:min_rpm:max_rpm[:start_duty:gamma:tau:cfm] */
+static int parse_fan(struct model *m, const char *arg)
+{
+	struct fan f = { .start_duty = 30, .gamma = 1, .tau = 1.5, .cfm = 60 };
+	int ch, n;
+
+	n = sscanf(arg, "%d:%d:%lf:%lf:%lf:%lf:%lf:%lf", &ch, &f.type, &f.min_rpm,
+		   &f.max_rpm, &f.start_duty, &f.gamma, &f.tau, &f.cfm);
+	if (n < 2 || ch < 1 || ch > NUM_FANS)
+		return -EINVAL;
+	if (f.type != 0 && f.type != 3 && f.type != 4)
+		return -EINVAL;
+	if (f.type && (n < 4 || f.max_rpm <= f.min_rpm || f.tau <= 0 || f.gamma <= 0))
+		return -EINVAL;
+
+	m->fans[ch - 1] = f;
+	return 0;
+}
+
+static int parse_latency_file(struct emu *e, const char *path)
+{
+	char line[256], result[16];
+	double avg_us;
+	FILE *fp;
+	int op;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return -errno;
+
+	/* opcode,result,status,min_us,avg_us,max_us,response as written by ccp-opscan */
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%i,%15[a-z],%*d,%*f,%lf", &op, result, &avg_us) != 3)
+			continue;
+		if (op < 0 || op > 0xff)
+			continue;
+		e->op_latency[op] = avg_us / 1e6;
+		e->op_invalid[op] = !strcmp(result, "invalid");
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+/* "<time ns> <seq> <type> <status> <bytes>" lines of the corsair-cpro capture log */
+static int parse_replay_file(struct emu *e, const char *path)
+{
+	char line[512], type[16], *p, *end;
+	unsigned long long time_ns;
+	struct replay_cmd *r;
+	size_t cap = 0, i;
+	double *sent = NULL;
+	unsigned int seq;
+	int status, n, k;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return -errno;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%llu %u %15s %d%n", &time_ns, &seq, type, &status, &n) != 4)
+			continue;
+
+		if (!strcmp(type, "tx")) {
+			if (e->replay_count == cap) {
+				cap = cap ? 2 * cap : 1024;
+				r = realloc(e->replay, cap * sizeof(*r));
+				p = r ? realloc(sent, cap * sizeof(*sent)) : NULL;
+				if (r)
+					e->replay = r;
+				if (!p) {
+					free(sent);
+					fclose(fp);
+					return -ENOMEM;
+				}
+				sent = (double *)p;
+			}
+			r = &e->replay[e->replay_count];
+			memset(r, 0, sizeof(*r));
+			r->seq = seq;
+			p = line + n;
+			for (k = 0; k < 2; k++) {
+				r->frame[k] = strtoul(p, &end, 16);
+				p = end;
+			}
+			sent[e->replay_count++] = time_ns / 1e9;
+			continue;
+		}
+
+		if (strcmp(type, "rx") || !seq)
+			continue;
+
+		/* responses follow their frame closely */
+		for (i = e->replay_count; i > 0 && i + REPLAY_WINDOW > e->replay_count; i--) {
+			r = &e->replay[i - 1];
+			if (r->seq != seq)
+				continue;
+			p = line + n;
+			for (k = 0; k < IN_BUFFER_SIZE; k++) {
+				r->reply[k] = strtoul(p, &end, 16);
+				p = end;
+			}
+			r->answered = 1;
+			r->latency = time_ns / 1e9 - sent[i - 1];
+			break;
+		}
+	}
+
+	free(sent);
+	fclose(fp);
+	return e->replay_count ? 0 : -ENODATA;
+}
+
+static void model_defaults(struct model *m)
+{
+	int i;
+
+	memset(m, 0, sizeof(*m));
+	m->ambient = 25;
+	m->c_src = 200;
+	m->c_case = 1500;
+	m->g_src = 1.0;
+	m->g_src_cfm = 0.02;
+	m->g_case = 0.5;
+	m->probes = 0xf;
+	m->target_gain = 0.02;
+	m->heat.shape = HEAT_CONST;
+	m->heat.p0 = 100;
+
+	/* three 4pin case fans and one 3pin fan */
+	for (i = 0; i < 4; i++) {
+		m->fans[i] = (struct fan){
+			.type = i < 3 ? 4 : 3,
+			.min_rpm = i < 3 ? 300 : 0,
+			.max_rpm = i < 3 ? 1800 : 1300,
+			.start_duty = 30,
+			.gamma = 1,
+			.tau = 1.5,
+			.cfm = 60,
+		};
+	}
+
+	/* the device starts with all fans at full speed */
+	for (i = 0; i < NUM_FANS; i++)
+		m->fans[i].duty = 100;
+	m->t_src = m->t_case = m->ambient;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -f, --fan CH:TYPE:MIN:MAX[:START:GAMMA:TAU:CFM]\n"
+		"                         fan model, TYPE 0 (none), 3 (3pin) or 4 (4pin)\n"
+		"  -H, --heat PROFILE     const:W, step:W0:W1:T, square:W0:W1:PERIOD,\n"
+		"                         sine:MEAN:AMP:PERIOD or ramp:W0:W1:T (default const:100)\n"
+		"  -p, --probes MASK      connected temperature probes (default 0xf)\n"
+		"  -a, --ambient C        ambient temperature (default 25)\n"
+		"  -l, --latency US       response latency per command (default 2000)\n"
+		"  -L, --latency-file F   per opcode latency and invalid opcodes from ccp-opscan\n"
+		"  -R, --replay FILE      answer with the responses and timing of a capture log\n"
+		"  -s, --speed X          simulated seconds per real second (default 1)\n"
+		"  -n, --noise X          reading noise in K and rpm (default 0)\n"
+		"  -S, --seed N           noise seed (default 1)\n"
+		"  -t, --trace FILE       write the model state as CSV\n"
+		"  -i, --trace-interval S trace interval in simulated s (default 1)\n"
+		"  -d, --duration S       stop after S simulated seconds\n"
+		"  -F, --firmware X.Y.Z   reported firmware version (default 0.9.214)\n"
+		"  -P, --product ID       usb product id (default 0x0c10)\n"
+		"  -T, --tag              echo opcode and frame byte 62 in response bytes 14-15\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option opts[] = {
+		{ "fan", required_argument, NULL, 'f' },
+		{ "heat", required_argument, NULL, 'H' },
+		{ "probes", required_argument, NULL, 'p' },
+		{ "ambient", required_argument, NULL, 'a' },
+		{ "latency", required_argument, NULL, 'l' },
+		{ "latency-file", required_argument, NULL, 'L' },
+		{ "replay", required_argument, NULL, 'R' },
+		{ "speed", required_argument, NULL, 's' },
+		{ "noise", required_argument, NULL, 'n' },
+		{ "seed", required_argument, NULL, 'S' },
+		{ "trace", required_argument, NULL, 't' },
+		{ "trace-interval", required_argument, NULL, 'i' },
+		{ "duration", required_argument, NULL, 'd' },
+		{ "firmware", required_argument, NULL, 'F' },
+		{ "product", required_argument, NULL, 'P' },
+		{ "tag", no_argument, NULL, 'T' },
+		{ "help", no_argument, NULL, 'h' },
+		{ }
+	};
+	static struct emu e;
+	struct pollfd pfd;
+	struct timespec ts;
+	double start, duration = 0, wait;
+	unsigned int fw[3];
+	int opt, i;
+
+	model_defaults(&e.m);
+	e.fw[0] = 0;
+	e.fw[1] = 9;
+	e.fw[2] = 214;
+	e.bl[0] = 0;
+	e.bl[1] = 5;
+	e.product = 0x0c10;
+	e.speed = 1;
+	e.latency = 0.002;
+	e.seed = 1;
+	e.trace_interval = 1;
+	for (i = 0; i < 256; i++)
+		e.op_latency[i] = -1;
+
+	while ((opt = getopt_long(argc, argv, "f:H:p:a:l:L:R:s:n:S:t:i:d:F:P:Th", opts, NULL)) != -1) {
+		switch (opt) {
+		case 'f':
+			if (parse_fan(&e.m, optarg)) {
+				fprintf(stderr, "invalid fan: %s\n", optarg);
+				return 1;
+			}
+			e.m.fans[atoi(optarg) - 1].duty = 100;
+			break;
+		case 'H':
+			if (parse_heat(&e.m.heat, optarg)) {
+				fprintf(stderr, "invalid heat profile: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'p':
+			e.m.probes = strtoul(optarg, NULL, 0) & 0xf;
+			break;
+		case 'a':
+			e.m.ambient = atof(optarg);
+			e.m.t_src = e.m.t_case = e.m.ambient;
+			break;
+		case 'l':
+			e.latency = atof(optarg) / 1e6;
+			break;
+		case 'L':
+			if (parse_latency_file(&e, optarg)) {
+				perror(optarg);
+				return 1;
+			}
+			break;
+		case 'R':
+			if (parse_replay_file(&e, optarg)) {
+				fprintf(stderr, "%s: no frames to replay\n", optarg);
+				return 1;
+			}
+			break;
+		case 's':
+			e.speed = atof(optarg);
+			break;
+		case 'n':
+			e.m.noise = atof(optarg);
+			break;
+		case 'S':
+			e.seed = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			e.trace = fopen(optarg, "w");
+			if (!e.trace) {
+				perror(optarg);
+				return 1;
+			}
+			break;
+		case 'i':
+			e.trace_interval = atof(optarg);
+			break;
+		case 'd':
+			duration = atof(optarg);
+			break;
+		case 'F':
+			if (sscanf(optarg, "%u.%u.%u", &fw[0], &fw[1], &fw[2]) != 3) {
+				fprintf(stderr, "invalid firmware version: %s\n", optarg);
+				return 1;
+			}
+			for (i = 0; i < 3; i++)
+				e.fw[i] = fw[i];
+			break;
+		case 'P':
+			e.product = strtoul(optarg, NULL, 0);
+			break;
+		case 'T':
+			e.tag = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (e.speed <= 0 || e.trace_interval <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	e.fd = open("/dev/uhid", O_RDWR | O_CLOEXEC);
+	if (e.fd < 0) {
+		perror("/dev/uhid");
+		return 1;
+	}
+
+	if (uhid_create(&e)) {
+		perror("uhid create");
+		return 1;
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	if (e.trace)
+		write_trace_header(&e);
+
+	pfd.fd = e.fd;
+	pfd.events = POLLIN;
+	start = now_s();
+
+	while (!stop && (!duration || e.m.time < duration)) {
+		/* catch the model up with real time */
+		e.now = (now_s() - start) * e.speed;
+		while (e.m.time + SIM_STEP <= e.now) {
+			model_step(&e.m, SIM_STEP);
+			write_trace(&e);
+		}
+		send_due_responses(&e);
+
+		wait = e.m.time + SIM_STEP - e.now;
+		if (e.count && e.queue[e.head].due - e.now < wait)
+			wait = e.queue[e.head].due - e.now;
+		wait = wait > 0 ? wait / e.speed : 0;
+		ts.tv_sec = wait;
+		ts.tv_nsec = (wait - ts.tv_sec) * 1e9;
+
+		if (ppoll(&pfd, 1, &ts, NULL) > 0) {
+			e.now = (now_s() - start) * e.speed;
+			handle_event(&e);
+		}
+	}
+
+	if (e.replay)
+		fprintf(stderr, "replayed %zu of %zu frames, %lu unexpected frames\n",
+			e.replay_pos, e.replay_count, e.replay_mismatch);
+
+	if (e.trace)
+		fclose(e.trace);
+	close(e.fd);	/* destroys the device */
+
+	return 0;
+}
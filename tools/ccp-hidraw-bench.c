@@ -0,0 +1,423 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * ccp-hidraw-bench.c - measure hidraw and hwmon clients racing for the same responses
+ *
+ * The device has no report ids, so a response goes to whoever waits first: the driver
+ * matches responses to its commands in order, and hidraw clients read every input
+ * report. This runs a hidraw client sending its own CTL_GET_FAN_RPM frames next to a
+ * hwmon client, and counts for both sides how many responses were right, belonged to
+ * the other side or never came.
+ *
+ * Needs ccp-emu --tag, which echoes byte 62 of each frame in response byte 15. The
+ * hidraw client marks its frames there, driver frames have 0. Driver side numbers come
+ * from the debugfs capture log, which is enabled during the run.
+ *
+ * Output is one CSV line per side:
+ * side,requests,ok,misattributed,timeouts,errors,ok_per_s,latency_avg_us
+ *
+ * For the driver, requests are frames it sent, misattributed are hidraw responses it
+ * matched to its frames and errors are responses it could not match. Latency is taken
+ * over hidraw requests and pwm1 writes, sensor reads mostly hit the driver cache.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEBUGFS_ROOT	"/sys/kernel/debug"
+#define HIDRAW_ROOT	"/sys/class/hidraw"
+#define OUT_BUFFER_SIZE	63
+#define IN_BUFFER_SIZE	16
+#define REQ_TIMEOUT_MS	300
+#define CTL_GET_FAN_RPM	0x21
+#define HIDRAW_TAG	0x80	/* set in byte 62 of hidraw frames */
+
+struct side {
+	unsigned long requests;
+	unsigned long ok;
+	unsigned long misattributed;
+	unsigned long timeouts;
+	unsigned long errors;
+	long long latency_ns;	/* sum over timed requests */
+	unsigned long timed;
+};
+
+struct bench {
+	char hidraw[PATH_MAX];
+	char hwmon[PATH_MAX];
+	char debugfs[PATH_MAX];
+	double duration;
+	double hidraw_rate;	/* requests per s, 0 back to back */
+	double hwmon_rate;
+	volatile int stop;
+	struct side hid, mon, drv;
+};
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void pace(long long *next, double rate)
+{
+	struct timespec ts;
+
+	if (rate <= 0)
+		return;
+	*next += 1e9 / rate;
+	ts.tv_sec = *next / 1000000000LL;
+	ts.tv_nsec = *next % 1000000000LL;
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+/* finds the hidraw node of an emulated device and its hwmon and debugfs directories */
+static int find_device(struct bench *b, const char *node)
+{
+	char path[256], link[PATH_MAX], line[256], *name;
+	struct dirent *de;
+	DIR *dir;
+	FILE *fp;
+	int found = 0;
+	ssize_t n;
+
+	dir = opendir(HIDRAW_ROOT);
+	if (!dir)
+		return -errno;
+
+	while (!found && (de = readdir(dir))) {
+		if (strncmp(de->d_name, "hidraw", 6))
+			continue;
+		if (node && strcmp(de->d_name, node))
+			continue;
+		snprintf(path, sizeof(path), "%s/%.64s/device/uevent", HIDRAW_ROOT, de->d_name);
+		fp = fopen(path, "r");
+		if (!fp)
+			continue;
+		while (fgets(line, sizeof(line), fp))
+			if (!strncmp(line, "HID_NAME=", 9) && (node || strstr(line, "ccp-emu")))
+				found = 1;
+		fclose(fp);
+		if (found)
+			snprintf(b->hidraw, sizeof(b->hidraw), "/dev/%.64s", de->d_name);
+	}
+	closedir(dir);
+	if (!found)
+		return -ENODEV;
+
+	/* the hid device name, e.g. 0003:1B1C:0C10.0005, names the debugfs directory */
+	snprintf(path, sizeof(path), "%s/%s/device", HIDRAW_ROOT, b->hidraw + 5);
+	n = readlink(path, link, sizeof(link) - 1);
+	if (n < 0)
+		return -errno;
+	link[n] = '\0';
+	name = strrchr(link, '/');
+	snprintf(b->debugfs, sizeof(b->debugfs), "%s/corsaircpro-%.64s", DEBUGFS_ROOT,
+		 name ? name + 1 : link);
+
+	snprintf(path, sizeof(path), "%s/%s/device/hwmon", HIDRAW_ROOT, b->hidraw + 5);
+	dir = opendir(path);
+	if (!dir)
+		return -errno;
+	found = 0;
+	while (!found && (de = readdir(dir))) {
+		if (strncmp(de->d_name, "hwmon", 5))
+			continue;
+		snprintf(b->hwmon, sizeof(b->hwmon), "%s/%.64s", path, de->d_name);
+		found = 1;
+	}
+	closedir(dir);
+
+	return found ? 0 : -ENODEV;
+}
+
+static void *hidraw_client(void *arg)
+{
+	struct bench *b = arg;
+	unsigned char frame[OUT_BUFFER_SIZE + 1], resp[IN_BUFFER_SIZE];
+	long long sent, next = now_ns(), left;
+	struct pollfd pfd;
+	unsigned int n = 0;
+	int first, tag;
+
+	pfd.fd = open(b->hidraw, O_RDWR | O_NONBLOCK);
+	if (pfd.fd < 0) {
+		perror(b->hidraw);
+		return NULL;
+	}
+	pfd.events = POLLIN;
+
+	while (!b->stop) {
+		/* throw away reports queued since the last request, like careful clients do */
+		while (read(pfd.fd, resp, sizeof(resp)) > 0)
+			;
+
+		memset(frame, 0, sizeof(frame));
+		tag = HIDRAW_TAG | (n++ & 0x7f);
+		frame[1] = CTL_GET_FAN_RPM;
+		frame[2] = n % 6;
+		frame[OUT_BUFFER_SIZE] = tag;
+
+		sent = now_ns();
+		b->hid.requests++;
+		if (write(pfd.fd, frame, sizeof(frame)) != sizeof(frame)) {
+			b->hid.errors++;
+			pace(&next, b->hidraw_rate);
+			continue;
+		}
+
+		for (first = 1;; first = 0) {
+			left = REQ_TIMEOUT_MS - (now_ns() - sent) / 1000000;
+			if (left <= 0 || poll(&pfd, 1, left) <= 0) {
+				b->hid.timeouts++;
+				break;
+			}
+			if (read(pfd.fd, resp, sizeof(resp)) != sizeof(resp))
+				continue;
+			if (resp[IN_BUFFER_SIZE - 1] == tag) {
+				if (first) {
+					b->hid.ok++;
+					b->hid.latency_ns += now_ns() - sent;
+					b->hid.timed++;
+				}
+				break;
+			}
+			/* a naive client would have taken this one */
+			if (first)
+				b->hid.misattributed++;
+		}
+
+		pace(&next, b->hidraw_rate);
+	}
+
+	close(pfd.fd);
+	return NULL;
+}
+
+static int sysfs_op(const char *dir, const char *attr, const char *val)
+{
+	char path[PATH_MAX + 64], buf[32];
+	int fd, ret = 0;
+	ssize_t n;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, attr);
+	fd = open(path, val ? O_WRONLY : O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	if (val)
+		n = write(fd, val, strlen(val));
+	else
+		n = read(fd, buf, sizeof(buf));
+	if (n < 0)
+		ret = -errno;
+	close(fd);
+
+	return ret;
+}
+
+/* reads the cached sensors and writes pwm1, which always reaches the device */
+static void *hwmon_client(void *arg)
+{
+	static const char * const inputs[] = {
+		"temp1_input", "fan1_input", "in0_input",
+	};
+	struct bench *b = arg;
+	long long start, next = now_ns();
+	unsigned int n = 0, i;
+	int ret;
+
+	while (!b->stop) {
+		for (i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+			b->mon.requests++;
+			ret = sysfs_op(b->hwmon, inputs[i], NULL);
+			if (!ret)
+				b->mon.ok++;
+			else if (ret == -ETIMEDOUT)
+				b->mon.timeouts++;
+			else
+				b->mon.errors++;
+		}
+
+		start = now_ns();
+		b->mon.requests++;
+		ret = sysfs_op(b->hwmon, "pwm1", n++ & 1 ? "128" : "129");
+		if (!ret) {
+			b->mon.ok++;
+			b->mon.latency_ns += now_ns() - start;
+			b->mon.timed++;
+		} else if (ret == -ETIMEDOUT) {
+			b->mon.timeouts++;
+		} else {
+			b->mon.errors++;
+		}
+
+		pace(&next, b->hwmon_rate);
+	}
+
+	return NULL;
+}
+
+/* "<time ns> <seq> <type> <status> <bytes>" */
+static void parse_capture_line(struct bench *b, const char *line)
+{
+	unsigned char resp[IN_BUFFER_SIZE] = { 0 };
+	long long time_ns;
+	unsigned int seq;
+	char type[16], *end;
+	const char *p;
+	int status, off, i;
+
+	if (sscanf(line, "%lld %u %15s %d%n", &time_ns, &seq, type, &status, &off) != 4)
+		return;
+
+	if (!strcmp(type, "tx")) {
+		b->drv.requests++;
+	} else if (!strcmp(type, "timeout")) {
+		b->drv.timeouts++;
+	} else if (!strcmp(type, "rx")) {
+		p = line + off;
+		for (i = 0; i < IN_BUFFER_SIZE; i++) {
+			resp[i] = strtoul(p, &end, 16);
+			if (end == p)
+				break;
+			p = end;
+		}
+		/* hidraw responses are seen by the driver too, only matched ones count */
+		if (!seq && !(resp[IN_BUFFER_SIZE - 1] & HIDRAW_TAG))
+			b->drv.errors++;
+		else if (seq && (resp[IN_BUFFER_SIZE - 1] & HIDRAW_TAG))
+			b->drv.misattributed++;
+		else if (seq)
+			b->drv.ok++;
+	}
+}
+
+static void drain_capture(struct bench *b, int fd)
+{
+	static char buf[65536], line[512];
+	static size_t len;
+	ssize_t n, i;
+
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		for (i = 0; i < n; i++) {
+			if (buf[i] != '\n') {
+				if (len < sizeof(line) - 1)
+					line[len++] = buf[i];
+				continue;
+			}
+			line[len] = '\0';
+			parse_capture_line(b, line);
+			len = 0;
+		}
+	}
+}
+
+static int capture_enable(struct bench *b, int on)
+{
+	return sysfs_op(b->debugfs, "capture", on ? "1" : "0");
+}
+
+static void print_side(const char *name, const struct side *s, double duration)
+{
+	printf("%s,%lu,%lu,%lu,%lu,%lu,%.1f,%lld\n", name, s->requests, s->ok,
+	       s->misattributed, s->timeouts, s->errors, s->ok / duration,
+	       s->timed ? s->latency_ns / (long long)s->timed / 1000 : 0);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -D NODE   hidraw node, e.g. hidraw3 (default: the ccp-emu device)\n"
+		"  -d S      duration (default 30)\n"
+		"  -r RATE   hidraw requests per s, 0 back to back (default 0)\n"
+		"  -w RATE   hwmon iterations per s, 0 back to back (default 0)\n"
+		"Start ccp-emu --tag first.\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	static struct bench b = { .duration = 30 };
+	char path[PATH_MAX + 16];
+	pthread_t hid, mon;
+	const char *node = NULL;
+	long long end;
+	int opt, fd;
+
+	while ((opt = getopt(argc, argv, "D:d:r:w:h")) != -1) {
+		switch (opt) {
+		case 'D':
+			node = optarg;
+			break;
+		case 'd':
+			b.duration = atof(optarg);
+			break;
+		case 'r':
+			b.hidraw_rate = atof(optarg);
+			break;
+		case 'w':
+			b.hwmon_rate = atof(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (b.duration <= 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (find_device(&b, node)) {
+		fprintf(stderr, "no corsair-cpro device with hidraw and hwmon found\n");
+		return 1;
+	}
+
+	if (capture_enable(&b, 1)) {
+		fprintf(stderr, "%s/capture: cannot enable, is debugfs mounted?\n", b.debugfs);
+		return 1;
+	}
+	snprintf(path, sizeof(path), "%s/capture", b.debugfs);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return 1;
+	}
+
+	pthread_create(&hid, NULL, hidraw_client, &b);
+	pthread_create(&mon, NULL, hwmon_client, &b);
+
+	/* the capture log keeps 1024 records, read it often enough */
+	end = now_ns() + b.duration * 1e9;
+	while (now_ns() < end) {
+		usleep(20000);
+		drain_capture(&b, fd);
+	}
+
+	b.stop = 1;
+	pthread_join(hid, NULL);
+	pthread_join(mon, NULL);
+	drain_capture(&b, fd);
+	close(fd);
+	capture_enable(&b, 0);
+
+	printf("side,requests,ok,misattributed,timeouts,errors,ok_per_s,latency_avg_us\n");
+	print_side("hidraw", &b.hid, b.duration);
+	print_side("hwmon", &b.mon, b.duration);
+	print_side("driver", &b.drv, b.duration);
+
+	return 0;
+}
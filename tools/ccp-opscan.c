@@ -0,0 +1,226 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * ccp-opscan.c - opcode discovery and latency profiling for the Corsair Commander Pro
+ *
+ * Sends every opcode in a range through the corsair-cpro debugfs raw_cmd file, records
+ * whether the device answers with 0x01 (invalid command), another error or data, and
+ * measures the round trip time reported by the driver.
+ *
+ * Output is one CSV line per opcode:
+ * opcode,result,status,min_us,avg_us,max_us,response
+ *
+ * ccp-emu --latency-file replays the latencies and invalid opcodes of such a file.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DEBUGFS_ROOT	"/sys/kernel/debug"
+#define OUT_BUFFER_SIZE	63
+#define IN_BUFFER_SIZE	16
+
+/*
+ * Known commands that change fan, lighting or device configuration. Sending them with a
+ * zero payload stops fans or resets lighting, so they are skipped unless --all is given.
+ */
+static const unsigned char setters[] = {
+	0x23, 0x24, 0x25, 0x26, 0x28,
+	0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b,
+};
+
+struct raw_result {
+	int status;
+	long long latency_ns;
+	unsigned char reply[IN_BUFFER_SIZE];
+};
+
+static int is_setter(int opcode)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(setters); i++)
+		if (setters[i] == opcode)
+			return 1;
+
+	return 0;
+}
+
+static int find_debugfs_dir(char *path, size_t len)
+{
+	struct dirent *de;
+	DIR *dir;
+	int ret = -ENOENT;
+
+	dir = opendir(DEBUGFS_ROOT);
+	if (!dir)
+		return -errno;
+
+	while ((de = readdir(dir))) {
+		if (strncmp(de->d_name, "corsaircpro-", 12))
+			continue;
+		snprintf(path, len, "%s/%s", DEBUGFS_ROOT, de->d_name);
+		ret = 0;
+		break;
+	}
+
+	closedir(dir);
+	return ret;
+}
+
+static int raw_cmd(int fd, const unsigned char *frame, size_t len, struct raw_result *res)
+{
+	char line[128];
+	char *p, *end;
+	ssize_t n;
+	int i;
+
+	if (pwrite(fd, frame, len, 0) != (ssize_t)len)
+		return -errno;
+
+	n = pread(fd, line, sizeof(line) - 1, 0);
+	if (n <= 0)
+		return n ? -errno : -EIO;
+	line[n] = '\0';
+
+	res->status = strtol(line, &p, 10);
+	res->latency_ns = strtoll(p, &p, 10);
+	for (i = 0; i < IN_BUFFER_SIZE; i++) {
+		res->reply[i] = strtoul(p, &end, 16);
+		if (end == p)
+			return -EINVAL;
+		p = end;
+	}
+
+	return 0;
+}
+
+static const char *classify(const struct raw_result *res)
+{
+	if (res->status)
+		return "timeout";
+
+	switch (res->reply[0]) {
+	case 0x00:
+		return "data";
+	case 0x01:
+		return "invalid";
+	default:
+		return "error";
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -d DIR    corsair-cpro debugfs directory (default: first corsaircpro-*)\n"
+		"  -f OP     first opcode (default 0x00)\n"
+		"  -l OP     last opcode (default 0xff)\n"
+		"  -b BYTE   value for byte 1, usually the channel (default 0)\n"
+		"  -n COUNT  repetitions per opcode for latency (default 10)\n"
+		"  -a        also send known setters, this changes fan and led state\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned char frame[OUT_BUFFER_SIZE] = { 0 };
+	long long min, max, sum;
+	struct raw_result res = { 0 };
+	char dir[PATH_MAX] = "";
+	char path[PATH_MAX + 16];
+	int first = 0x00, last = 0xff, byte1 = 0, count = 10, all = 0;
+	int opcode, i, fd, opt, ret;
+
+	while ((opt = getopt(argc, argv, "d:f:l:b:n:ah")) != -1) {
+		switch (opt) {
+		case 'd':
+			snprintf(dir, sizeof(dir), "%s", optarg);
+			break;
+		case 'f':
+			first = strtol(optarg, NULL, 0);
+			break;
+		case 'l':
+			last = strtol(optarg, NULL, 0);
+			break;
+		case 'b':
+			byte1 = strtol(optarg, NULL, 0);
+			break;
+		case 'n':
+			count = strtol(optarg, NULL, 0);
+			break;
+		case 'a':
+			all = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (first < 0 || last > 0xff || first > last || count < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (!dir[0] && find_debugfs_dir(dir, sizeof(dir))) {
+		fprintf(stderr, "no corsaircpro debugfs directory found, is debugfs mounted?\n");
+		return 1;
+	}
+
+	snprintf(path, sizeof(path), "%s/raw_cmd", dir);
+	fd = open(path, O_RDWR);
+	if (fd < 0) {
+		perror(path);
+		return 1;
+	}
+
+	printf("opcode,result,status,min_us,avg_us,max_us,response\n");
+
+	for (opcode = first; opcode <= last; opcode++) {
+		if (!all && is_setter(opcode))
+			continue;
+
+		frame[0] = opcode;
+		frame[1] = byte1;
+		min = LLONG_MAX;
+		max = 0;
+		sum = 0;
+
+		for (i = 0; i < count; i++) {
+			ret = raw_cmd(fd, frame, sizeof(frame), &res);
+			if (ret) {
+				fprintf(stderr, "opcode 0x%02x: %s\n", opcode, strerror(-ret));
+				close(fd);
+				return 1;
+			}
+			if (res.latency_ns < min)
+				min = res.latency_ns;
+			if (res.latency_ns > max)
+				max = res.latency_ns;
+			sum += res.latency_ns;
+			/* a timeout takes REQ_TIMEOUT, do not repeat it */
+			if (res.status) {
+				i++;
+				break;
+			}
+		}
+
+		printf("0x%02x,%s,%d,%lld,%lld,%lld,", opcode, classify(&res), res.status,
+		       min / 1000, sum / i / 1000, max / 1000);
+		for (i = 0; i < IN_BUFFER_SIZE; i++)
+			printf("%02x", res.reply[i]);
+		printf("\n");
+		fflush(stdout);
+	}
+
+	close(fd);
+	return 0;
+}
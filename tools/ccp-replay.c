@@ -0,0 +1,314 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * ccp-replay.c - replay a corsair-cpro capture log through the debugfs raw_cmd file
+ *
+ * Sends the recorded frames with their recorded spacing, or back to back with -f, and
+ * compares the new round trip times and response codes with the recorded ones. Run it
+ * against ccp-emu --replay of the same log to reproduce the traffic of a field host
+ * with its device timing, or against real hardware to benchmark transport changes.
+ *
+ * raw_cmd sends one frame at a time, so frames recorded in flight together are sent
+ * one after another.
+ *
+ * Output is one CSV line per frame:
+ * seq,opcode,recorded_us,replayed_us,recorded_result,replayed_result
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEBUGFS_ROOT	"/sys/kernel/debug"
+#define OUT_BUFFER_SIZE	63
+#define IN_BUFFER_SIZE	16
+
+struct frame {
+	unsigned int seq;
+	long long sent_ns;
+	unsigned char out[OUT_BUFFER_SIZE];
+	int len;
+	long long latency_ns;	/* -1 if never answered */
+	int result;		/* response byte 0, -1 if never answered */
+};
+
+static int find_debugfs_dir(char *path, size_t len)
+{
+	struct dirent *de;
+	DIR *dir;
+	int ret = -ENOENT;
+
+	dir = opendir(DEBUGFS_ROOT);
+	if (!dir)
+		return -errno;
+
+	while ((de = readdir(dir))) {
+		if (strncmp(de->d_name, "corsaircpro-", 12))
+			continue;
+		snprintf(path, len, "%s/%s", DEBUGFS_ROOT, de->d_name);
+		ret = 0;
+		break;
+	}
+
+	closedir(dir);
+	return ret;
+}
+
+static int parse_bytes(const char *p, unsigned char *buf, int max)
+{
+	char *end;
+	int n = 0;
+
+	while (n < max) {
+		buf[n] = strtoul(p, &end, 16);
+		if (end == p)
+			break;
+		p = end;
+		n++;
+	}
+
+	return n;
+}
+
+/* "<time ns> <seq> <type> <status> <bytes>" lines of the capture log */
+static struct frame *load_capture(const char *path, size_t *count)
+{
+	struct frame *frames = NULL, *f, *tmp;
+	unsigned char reply[IN_BUFFER_SIZE];
+	char line[512], type[16];
+	long long time_ns;
+	size_t n = 0, cap = 0, i;
+	unsigned int seq;
+	int status, off;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return NULL;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%lld %u %15s %d%n", &time_ns, &seq, type, &status, &off) != 4)
+			continue;
+
+		if (!strcmp(type, "tx")) {
+			if (n == cap) {
+				cap = cap ? 2 * cap : 1024;
+				tmp = realloc(frames, cap * sizeof(*frames));
+				if (!tmp) {
+					free(frames);
+					fclose(fp);
+					return NULL;
+				}
+				frames = tmp;
+			}
+			f = &frames[n++];
+			memset(f, 0, sizeof(*f));
+			f->seq = seq;
+			f->sent_ns = time_ns;
+			f->len = parse_bytes(line + off, f->out, OUT_BUFFER_SIZE);
+			f->latency_ns = -1;
+			f->result = -1;
+			continue;
+		}
+
+		if (strcmp(type, "rx") || !seq)
+			continue;
+
+		for (i = n; i > 0; i--) {
+			f = &frames[i - 1];
+			if (f->seq != seq)
+				continue;
+			if (parse_bytes(line + off, reply, IN_BUFFER_SIZE) > 0)
+				f->result = reply[0];
+			f->latency_ns = time_ns - f->sent_ns;
+			break;
+		}
+	}
+
+	fclose(fp);
+	*count = n;
+	return frames;
+}
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sleep_until_ns(long long t)
+{
+	struct timespec ts;
+
+	ts.tv_sec = t / 1000000000LL;
+	ts.tv_nsec = t % 1000000000LL;
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+static int raw_cmd(int fd, const struct frame *f, long long *latency_ns, int *result)
+{
+	unsigned char reply[IN_BUFFER_SIZE];
+	char line[128], *p;
+	int status;
+	ssize_t n;
+
+	*latency_ns = -1;
+	*result = -1;
+
+	if (pwrite(fd, f->out, f->len, 0) != f->len)
+		return -errno;
+
+	n = pread(fd, line, sizeof(line) - 1, 0);
+	if (n <= 0)
+		return n ? -errno : -EIO;
+	line[n] = '\0';
+
+	status = strtol(line, &p, 10);
+	*latency_ns = strtoll(p, &p, 10);
+	if (parse_bytes(p, reply, IN_BUFFER_SIZE) != IN_BUFFER_SIZE)
+		return -EINVAL;
+	if (!status)
+		*result = reply[0];
+	else
+		*latency_ns = -1;
+
+	return 0;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* prints median, 99th percentile and maximum of the answered frames */
+static void print_percentiles(const char *name, long long *v, size_t n)
+{
+	if (!n) {
+		fprintf(stderr, "%s: no answered frames\n", name);
+		return;
+	}
+	qsort(v, n, sizeof(*v), cmp_ll);
+	fprintf(stderr, "%s: p50 %lld us, p99 %lld us, max %lld us\n", name,
+		v[n / 2] / 1000, v[n * 99 / 100] / 1000, v[n - 1] / 1000);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options] CAPTURE\n"
+		"  -d DIR    corsair-cpro debugfs directory (default: first corsaircpro-*)\n"
+		"  -f        send frames back to back instead of with the recorded spacing\n"
+		"  -n COUNT  replay only the first COUNT frames\n"
+		"CAPTURE is a saved copy of the debugfs capture file. The frames are\n"
+		"sent as recorded, including fan and led setters.\n",
+		prog);
+}
+
+int main(int argc, char **argv)
+{
+	long long *rec_lat, *rep_lat, start, latency;
+	size_t count, limit = 0, n_rec = 0, n_rep = 0, i;
+	unsigned long changed = 0;
+	char dir[PATH_MAX] = "";
+	char path[PATH_MAX + 16];
+	struct frame *frames;
+	int fast = 0, opt, fd, result, ret;
+
+	while ((opt = getopt(argc, argv, "d:fn:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			snprintf(dir, sizeof(dir), "%s", optarg);
+			break;
+		case 'f':
+			fast = 1;
+			break;
+		case 'n':
+			limit = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	frames = load_capture(argv[optind], &count);
+	if (!frames || !count) {
+		fprintf(stderr, "%s: no frames\n", argv[optind]);
+		return 1;
+	}
+	if (limit && limit < count)
+		count = limit;
+
+	if (!dir[0] && find_debugfs_dir(dir, sizeof(dir))) {
+		fprintf(stderr, "no corsaircpro debugfs directory found, is debugfs mounted?\n");
+		return 1;
+	}
+
+	snprintf(path, sizeof(path), "%s/raw_cmd", dir);
+	fd = open(path, O_RDWR);
+	if (fd < 0) {
+		perror(path);
+		return 1;
+	}
+
+	rec_lat = calloc(count, sizeof(*rec_lat));
+	rep_lat = calloc(count, sizeof(*rep_lat));
+	if (!rec_lat || !rep_lat) {
+		close(fd);
+		return 1;
+	}
+
+	printf("seq,opcode,recorded_us,replayed_us,recorded_result,replayed_result\n");
+
+	start = now_ns();
+	for (i = 0; i < count; i++) {
+		const struct frame *f = &frames[i];
+
+		/* late frames are sent right away, the schedule is not shifted */
+		if (!fast)
+			sleep_until_ns(start + f->sent_ns - frames[0].sent_ns);
+
+		ret = raw_cmd(fd, f, &latency, &result);
+		if (ret) {
+			fprintf(stderr, "frame %u: %s\n", f->seq, strerror(-ret));
+			close(fd);
+			return 1;
+		}
+
+		printf("%u,0x%02x,%lld,%lld,%d,%d\n", f->seq, f->out[0],
+		       f->latency_ns < 0 ? -1 : f->latency_ns / 1000,
+		       latency < 0 ? -1 : latency / 1000, f->result, result);
+
+		if (f->latency_ns >= 0)
+			rec_lat[n_rec++] = f->latency_ns;
+		if (latency >= 0)
+			rep_lat[n_rep++] = latency;
+		if (result != f->result)
+			changed++;
+	}
+
+	fprintf(stderr, "%zu frames, %lu with a different result\n", count, changed);
+	print_percentiles("recorded", rec_lat, n_rec);
+	print_percentiles("replayed", rep_lat, n_rep);
+
+	free(rec_lat);
+	free(rep_lat);
+	free(frames);
+	close(fd);
+	return 0;
+}